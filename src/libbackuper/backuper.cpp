@@ -0,0 +1,93 @@
+#include "backuper.hpp"
+#include "../my_backup/backup/backup.hpp"
+#include "../my_restore/restore/restore.hpp"
+#include "../util/format.hpp"
+
+#include <chrono>
+#include <new>
+#include <stdexcept>
+
+#include <boost/filesystem.hpp>
+#include <boost/system/error_code.hpp>
+
+namespace backuper {
+
+namespace {
+namespace fs = boost::filesystem;
+namespace system = boost::system;
+} // namespace
+
+Job::Job(JobOptions options, ProgressCallback on_progress)
+    : options_{std::move(options)},
+      context_{std::move(on_progress)},
+      done_{done_promise_.get_future().share()},
+      thread_{[this] { Run(); }} {
+}
+
+Job::~Job() {
+  Cancel();
+  thread_.join();
+}
+
+void Job::Cancel() {
+  context_.Cancel();
+}
+
+void Job::Wait() const {
+  done_.wait();
+}
+
+bool Job::IsDone() const {
+  return done_.wait_for(std::chrono::seconds{0}) == std::future_status::ready;
+}
+
+system::error_code Job::GetError() const {
+  Wait();
+  return error_;
+}
+
+std::vector<FileError> Job::GetFileErrors() const {
+  return context_.GetFileErrors();
+}
+
+void Job::Run() {
+  util::format::is_quiet = true;
+  RunJob(options_, context_, error_);
+  done_promise_.set_value();
+}
+
+void RunJob(const JobOptions& options, util::job::Context& context,
+            system::error_code& error) {
+  try {
+    switch (options.kind) {
+      case JobKind::kFullBackup:
+        backup::PerformFullBackup(options.from, options.to, options.key, context,
+                                  error);
+        break;
+      case JobKind::kIncrementalBackup:
+        backup::PerformIncrementalBackup(options.from, options.to,
+                                         options.memory_limit, options.key,
+                                         context, error);
+        break;
+      case JobKind::kRestore:
+        restore::Restore(options.from, options.to, options.key, context, error);
+        break;
+    }
+  } catch (const fs::filesystem_error& e) {
+    error = e.code();
+  } catch (const std::logic_error&) {
+    error = system::errc::make_error_code(system::errc::invalid_argument);
+  } catch (const std::bad_alloc&) {
+    error = system::errc::make_error_code(system::errc::not_enough_memory);
+  } catch (...) {
+    // Whatever else is thrown, the job must end with an error rather than
+    // leave its waiters hanging
+    error = system::errc::make_error_code(system::errc::state_not_recoverable);
+  }
+}
+
+std::unique_ptr<Job> StartJob(JobOptions options, ProgressCallback on_progress) {
+  return std::make_unique<Job>(std::move(options), std::move(on_progress));
+}
+
+} // namespace backuper
\ No newline at end of file
@@ -0,0 +1,89 @@
+#pragma once
+
+#include "../util/crypto/cipher.hpp"
+#include "../util/job/context.hpp"
+
+#include <atomic>
+#include <future>
+#include <limits>
+#include <memory>
+#include <optional>
+#include <thread>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+#include <boost/system/error_code.hpp>
+
+namespace backuper {
+
+namespace {
+namespace fs = boost::filesystem;
+namespace system = boost::system;
+} // namespace
+
+using util::job::FileError;
+using util::job::Progress;
+using util::job::ProgressCallback;
+
+enum class JobKind {
+  kFullBackup,
+  kIncrementalBackup,
+  kRestore,
+};
+
+struct JobOptions {
+  JobKind kind = JobKind::kFullBackup;
+  fs::path from;
+  fs::path to;
+  // The memory limit of an incremental backup, see
+  // backup::PerformIncrementalBackup
+  size_t memory_limit = std::numeric_limits<size_t>::max();
+  // Encrypts the backup or decrypts the restored one
+  std::optional<util::crypto::Key> key;
+};
+
+// A backup or a restore running on its own thread. The progress callback is
+// called on that thread. Nothing is printed: a failed entry is listed by
+// GetFileErrors and does not stop the job. Destroying the handle cancels the
+// job and waits for it
+class Job {
+ public:
+  Job(JobOptions options, ProgressCallback on_progress);
+
+  Job(const Job&) = delete;
+  Job& operator=(const Job&) = delete;
+
+  ~Job();
+
+  // A cancelled backup keeps its staging dir, so the next run of the same
+  // kind resumes it
+  void Cancel();
+
+  void Wait() const;
+
+  bool IsDone() const;
+
+  // The error that stopped the job. Valid once the job is done
+  system::error_code GetError() const;
+
+  std::vector<FileError> GetFileErrors() const;
+
+ private:
+  void Run();
+
+  JobOptions options_;
+  util::job::Context context_;
+  system::error_code error_;
+  std::promise<void> done_promise_;
+  std::shared_future<void> done_;
+  std::thread thread_;
+};
+
+std::unique_ptr<Job> StartJob(JobOptions options, ProgressCallback on_progress);
+
+// Runs the job on the calling thread. Never throws, a failure of any kind is
+// the error of the job
+void RunJob(const JobOptions& options, util::job::Context& context,
+            system::error_code& error);
+
+} // namespace backuper
\ No newline at end of file
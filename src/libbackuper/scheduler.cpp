@@ -0,0 +1,141 @@
+#include "scheduler.hpp"
+#include "../util/format.hpp"
+
+#include <algorithm>
+#include <thread>
+
+#include <sys/stat.h>
+
+#include <boost/filesystem.hpp>
+#include <boost/system/error_code.hpp>
+
+namespace backuper {
+
+namespace {
+namespace fs = boost::filesystem;
+namespace system = boost::system;
+
+// The destination may not exist yet, then its closest existing parent tells
+// the device
+dev_t GetDeviceId(const fs::path& path) {
+  fs::path existing = path;
+  struct stat stat {};
+  while (::stat(existing.c_str(), &stat) < 0 && existing.has_parent_path()) {
+    existing = existing.parent_path();
+  }
+  return stat.st_dev;
+}
+
+} // namespace
+
+Scheduler::Scheduler(size_t workers, size_t jobs_per_device)
+    : workers_{std::max<size_t>(workers, 1)},
+      jobs_per_device_{std::max<size_t>(jobs_per_device, 1)} {
+}
+
+void Scheduler::Add(JobOptions options) {
+  system::error_code error;
+  auto destination = fs::weakly_canonical(fs::absolute(options.to), error);
+  if (error) {
+    destination = fs::absolute(options.to).lexically_normal();
+  }
+  auto device_id = GetDeviceId(destination);
+
+  auto device = std::ranges::find(devices_, device_id, &Device::id);
+  if (device == devices_.end()) {
+    device = devices_.insert(devices_.end(), Device{device_id, {}, 0});
+  }
+  device->pending.push_back(jobs_.size());
+
+  job_devices_.push_back(device - devices_.begin());
+  destinations_.push_back(std::move(destination));
+  contexts_.push_back(std::make_unique<util::job::Context>(ProgressCallback{}));
+  results_.push_back({options, {}, {}});
+  jobs_.push_back(std::move(options));
+  ++pending_count_;
+}
+
+std::vector<JobResult> Scheduler::Run() {
+  std::vector<std::thread> workers;
+  for (size_t i = 0; i < std::min(workers_, jobs_.size()); ++i) {
+    workers.emplace_back([this] { RunWorker(); });
+  }
+  for (auto& worker : workers) {
+    worker.join();
+  }
+
+  return std::move(results_);
+}
+
+void Scheduler::Cancel() {
+  std::lock_guard lock{mutex_};
+  for (auto& context : contexts_) {
+    context->Cancel();
+  }
+}
+
+void Scheduler::RunWorker() {
+  util::format::is_quiet = true;
+
+  while (true) {
+    size_t job = 0;
+    {
+      std::unique_lock lock{mutex_};
+      bool is_picked = false;
+      job_finished_.wait(lock, [&] {
+        is_picked = TryPickJob(job);
+        return is_picked || pending_count_ == 0;
+      });
+      if (!is_picked) {
+        return;
+      }
+    }
+
+    auto& result = results_[job];
+    auto& context = *contexts_[job];
+    if (!context.CheckCancelled(result.error)) {
+      RunJob(jobs_[job], context, result.error);
+    }
+    result.file_errors = context.GetFileErrors();
+
+    FinishJob(job);
+  }
+}
+
+bool Scheduler::TryPickJob(size_t& job) {
+  for (size_t i = 0; i < devices_.size(); ++i) {
+    size_t device_index = (next_device_ + i) % devices_.size();
+    auto& device = devices_[device_index];
+    if (device.running >= jobs_per_device_) {
+      continue;
+    }
+
+    auto pending = std::ranges::find_if(device.pending, [this](size_t job) {
+      return !busy_destinations_.contains(destinations_[job]);
+    });
+    if (pending == device.pending.end()) {
+      continue;
+    }
+
+    job = *pending;
+    device.pending.erase(pending);
+    ++device.running;
+    busy_destinations_.insert(destinations_[job]);
+    --pending_count_;
+    next_device_ = device_index + 1;
+    return true;
+  }
+
+  return false;
+}
+
+void Scheduler::FinishJob(size_t job) {
+  {
+    std::lock_guard lock{mutex_};
+    --devices_[job_devices_[job]].running;
+    busy_destinations_.erase(destinations_[job]);
+  }
+  job_finished_.notify_all();
+}
+
+} // namespace backuper
\ No newline at end of file
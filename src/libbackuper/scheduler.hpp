@@ -0,0 +1,81 @@
+#pragma once
+
+#include "backuper.hpp"
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <vector>
+
+#include <sys/types.h>
+
+#include <boost/filesystem.hpp>
+#include <boost/system/error_code.hpp>
+
+namespace backuper {
+
+namespace {
+namespace fs = boost::filesystem;
+namespace system = boost::system;
+} // namespace
+
+struct JobResult {
+  JobOptions options;
+  system::error_code error;
+  std::vector<FileError> file_errors;
+};
+
+// Runs many jobs in one process on a shared pool of workers. The jobs are
+// queued per device of their destination, and the devices are served in
+// turn, so that every device is kept busy with at most jobs_per_device jobs
+// and no device starves the others. Jobs with the same destination never
+// run at once, as they would share the staging dir
+class Scheduler {
+ public:
+  Scheduler(size_t workers, size_t jobs_per_device);
+
+  Scheduler(const Scheduler&) = delete;
+  Scheduler& operator=(const Scheduler&) = delete;
+
+  void Add(JobOptions options);
+
+  // Blocks until all the jobs are done. The results are in the order the
+  // jobs were added
+  std::vector<JobResult> Run();
+
+  void Cancel();
+
+ private:
+  struct Device {
+    dev_t id;
+    std::deque<size_t> pending;
+    size_t running = 0;
+  };
+
+  void RunWorker();
+
+  // Takes the next job of the first device in turn that may start one
+  bool TryPickJob(size_t& job);
+
+  void FinishJob(size_t job);
+
+  const size_t workers_;
+  const size_t jobs_per_device_;
+
+  std::vector<JobOptions> jobs_;
+  std::vector<fs::path> destinations_;
+  std::vector<size_t> job_devices_;
+  std::vector<std::unique_ptr<util::job::Context>> contexts_;
+  std::vector<JobResult> results_;
+
+  std::mutex mutex_;
+  std::condition_variable job_finished_;
+  std::vector<Device> devices_;
+  std::set<fs::path> busy_destinations_;
+  size_t next_device_ = 0;
+  size_t pending_count_ = 0;
+};
+
+} // namespace backuper
\ No newline at end of file
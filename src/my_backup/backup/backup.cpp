@@ -1,13 +1,22 @@
 #include "backup.hpp"
 
+#include "../../util/backup/checkpoint.hpp"
 #include "../../util/backup/full_backup.hpp"
+#include "../../util/backup/snapshot.hpp"
+#include "../../util/crypto/cipher.hpp"
 #include "../../util/filesystem/copy.hpp"
+#include "../../util/filesystem/metadata.hpp"
+#include "../../util/job/context.hpp"
 #include "../../util/format.hpp"
 
 #include <algorithm>
 #include <fmt/color.h>
+#include <iomanip>
+#include <optional>
+#include <sstream>
 #include <unordered_map>
 #include <unordered_set>
+#include <vector>
 
 #include <fmt/chrono.h>
 
@@ -25,6 +34,77 @@ using BackupTree =
 const int kNoSuchFile =
     static_cast<int>(system::errc::no_such_file_or_directory);
 
+// Approximate cost of a path in BackupTree besides the characters: the
+// hash nodes, buckets and string headers
+const size_t kIndexEntryOverhead = 128;
+
+std::string GetKeyId(const std::optional<util::crypto::Key>& key) {
+  return key ? util::crypto::GetKeyId(*key) : std::string{};
+}
+
+// What a staging dir is resumed against: the copies of another source, diffed
+// against another full backup or made with another key are discarded
+std::string ComposeCheckpointBase(const fs::path& from,
+                                  const std::string& latest_backup,
+                                  const std::optional<util::crypto::Key>& key,
+                                  system::error_code& error) {
+  auto source = fs::canonical(from, error);
+  if (error) {
+    util::format::PrintError("Error while resolving {}\n",
+                             from.generic_string());
+    return {};
+  }
+
+  std::ostringstream base;
+  base << std::quoted(source.generic_string()) << ' '
+       << std::quoted(latest_backup) << ' ' << GetKeyId(key);
+  return base.str();
+}
+
+// The backup being written: its staging dir, the journal of the paths
+// copied into it, the metadata of these paths, the cipher of the copies if
+// they are encrypted and the job it is made by
+struct StagedBackup {
+  StagedBackup(fs::path staging, const std::string& base,
+               const std::optional<util::crypto::Key>& key,
+               util::job::Context& context, system::error_code& error)
+      : dir{std::move(staging)},
+        checkpoint{dir, base, error},
+        metadata_writer{util::backup::GetServiceDir(dir)},
+        context{context} {
+    // A journaled path must never lack its metadata
+    checkpoint.SetOnFlush([this](system::error_code& error) {
+      metadata_writer.Flush(error);
+    });
+    if (!error) {
+      metadata_writer.Resume(error);
+    }
+    if (key && !error) {
+      cipher.emplace(*key, util::crypto::Direction::kEncrypt);
+      util::backup::MarkAsEncrypted(dir, GetKeyId(key), error);
+    }
+  }
+
+  StagedBackup(const StagedBackup&) = delete;
+  StagedBackup& operator=(const StagedBackup&) = delete;
+
+  // Keeps the work done by a cancelled or failed run for the next one
+  ~StagedBackup() {
+    system::error_code error;
+    checkpoint.Flush(error);
+  }
+
+  const util::crypto::Cipher* GetCipher() const {
+    return cipher ? &*cipher : nullptr;
+  }
+
+  fs::path dir;
+  util::backup::Checkpoint checkpoint;
+  util::filesystem::MetadataWriter metadata_writer;
+  std::optional<util::crypto::Cipher> cipher;
+  util::job::Context& context;
+};
+
 bool CheckIsDirectory(const fs::path& to, system::error_code& error) {
   bool is_dir = fs::is_directory(to, error);
   if (error && error.value() != kNoSuchFile) {
@@ -64,45 +144,219 @@ void CreateDirs(const fs::path& to, system::error_code& error) {
   }
 }
 
-void CreateSubdirForBackup(fs::path& to, system::error_code& error) {
+bool CheckIsBackupRoot(const fs::path& to, system::error_code& error) {
   bool is_dir = CheckIsDirectory(to, error);
   if (error) {
-    return;
+    return false;
   }
 
   if (!is_dir) {
+    error = system::errc::make_error_code(system::errc::not_a_directory);
     util::format::PrintError("Path {} is not a directory\n",
                              to.generic_string());
-    return;
+    return false;
   }
 
+  return true;
+}
+
+fs::path ComposeSubdirForBackup(const fs::path& to, system::error_code& error) {
   std::time_t time = std::time(nullptr);
   std::string now = fmt::format("{:%Y-%m-%d_%H-%M-%S}", fmt::localtime(time));
-  to /= fmt::format("/{}", now);
+  fs::path subdir = to / now;
 
-  bool exists = CheckExists(to, error);
+  bool exists = CheckExists(subdir, error);
   if (error) {
-    return;
+    return {};
   }
 
   if (exists) {
-    fs::remove_all(to, error);
+    fs::remove_all(subdir, error);
     if (error) {
       util::format::PrintError("Error while deleting duplicate dir {}\n",
-                               to.generic_string());
+                               subdir.generic_string());
+      return {};
+    }
+  }
+
+  return subdir;
+}
+
+// Moves a completed staging dir to its timestamped place. The timestamp is
+// taken at commit, so a resumed backup is still ordered after the runs it
+// depends on
+fs::path CommitBackup(const fs::path& staging, const fs::path& to,
+                      system::error_code& error) {
+  fs::path subdir = ComposeSubdirForBackup(to, error);
+  if (error) {
+    return {};
+  }
+
+  util::backup::CommitStagingDir(staging, subdir, error);
+  return subdir;
+}
+
+void CaptureMetadata(const std::string& entry, const std::string& value,
+                     StagedBackup& staged, system::error_code& error) {
+  auto metadata = util::filesystem::CaptureMetadata(entry, error);
+  if (error) {
+    return;
+  }
+  staged.metadata_writer.Write(value, metadata, error);
+}
+
+// Captures the metadata of an entry copied with all its subtree
+void CaptureMetadataTree(const std::string& entry, const std::string& value,
+                         const fs::file_status& entry_stat,
+                         StagedBackup& staged, system::error_code& error) {
+  CaptureMetadata(entry, value, staged, error);
+  if (error || entry_stat.type() != fs::file_type::directory_file) {
+    return;
+  }
+
+  // The unreadable dirs are reported by the copy, their metadata is still
+  // captured
+  const size_t kEntryLen = entry.size();
+  for (auto it = fs::recursive_directory_iterator{
+           entry, fs::directory_options::skip_permission_denied, error};
+       !error && it != fs::recursive_directory_iterator{};
+       it.increment(error)) {
+    const auto& str_path = it->path().generic_string();
+    CaptureMetadata(str_path, value + str_path.substr(kEntryLen), staged,
+                    error);
+    if (error) {
       return;
     }
   }
 
-  CreateDirs(to, error);
+  if (error) {
+    util::format::PrintError("Error while iterating through dir {}\n", entry);
+  }
+}
+
+void CopyEntry(const std::string& entry, const std::string& value,
+               StagedBackup& staged, system::error_code& error) {
+  auto entry_stat = fs::symlink_status(entry, error);
+  if (error) {
+    util::format::PrintError("Error while getting info on {}\n", entry);
+    return;
+  }
+
+  fs::path dest = staged.dir / util::backup::GetSnapshotValue(value);
+  if (entry_stat.type() == fs::file_type::directory_file) {
+    CreateDirs(dest, error);
+  } else {
+    util::filesystem::CopyFromTo(entry, dest, error,
+                                 fs::copy_options::overwrite_existing,
+                                 staged.GetCipher(),
+                                 util::filesystem::Attributes::kCopy);
+  }
+  if (error) {
+    return;
+  }
+
+  CaptureMetadata(entry, value, staged, error);
 }
 
-bool PerformIncrementalBackupFastPath(const fs::path& from, fs::path to,
-                                      system::error_code& error) {
+std::vector<std::string> GetSortedDirEntries(const std::string& dir,
+                                             system::error_code& error) {
+  std::vector<std::string> names;
+  for (auto it = fs::directory_iterator{dir, error};
+       !error && it != fs::directory_iterator{}; it.increment(error)) {
+    names.push_back(it->path().filename().generic_string());
+  }
+
+  if (error.value() == kNoSuchFile) {
+    error.clear();
+  } else if (error) {
+    util::format::PrintError("Error while iterating through dir {}\n", dir);
+  }
+
+  std::ranges::sort(names);
+  return names;
+}
+
+// An unreadable dir of the source is reported and skipped. Only the source
+// itself must be readable
+std::vector<std::string> ListSourceDir(const fs::path& from,
+                                       const std::string& dir_value,
+                                       StagedBackup& staged,
+                                       system::error_code& error) {
+  system::error_code dir_error;
+  auto names =
+      GetSortedDirEntries(from.generic_string() + dir_value, dir_error);
+  if (dir_error && dir_value.empty()) {
+    error = dir_error;
+  } else if (dir_error) {
+    staged.context.ReportFileError(from.generic_string() + dir_value,
+                                   dir_error);
+  }
+  return names;
+}
+
+// Symlinks to dirs are copied as symlinks and not walked into
+bool IsDirToWalk(const std::string& entry) {
+  system::error_code error;
+  return fs::symlink_status(entry, error).type() ==
+         fs::file_type::directory_file;
+}
+
+// Copies the subtree of the source dir depth first, with the entries of every
+// dir sorted by name, as the journal expects. A dir is journaled before its
+// subtree, so the dirs the last journaled path is in are walked again on
+// resume without being copied
+void CopyWithCheckpoint(const fs::path& from, const std::string& dir_value,
+                        StagedBackup& staged, system::error_code& error) {
+  auto names = ListSourceDir(from, dir_value, staged, error);
+  if (error) {
+    return;
+  }
+
+  for (const auto& name : names) {
+    if (staged.context.CheckCancelled(error)) {
+      return;
+    }
+
+    std::string value = dir_value + '/' + name;
+    auto state = staged.checkpoint.GetState(value);
+    if (state == util::backup::PathState::kCompleted) {
+      continue;
+    }
+
+    std::string entry = from.generic_string() + value;
+    if (state == util::backup::PathState::kPending) {
+      // A failed entry is reported with its subtree left out
+      system::error_code entry_error;
+      CopyEntry(entry, value, staged, entry_error);
+      if (entry_error) {
+        staged.context.ReportFileError(entry, entry_error);
+        continue;
+      }
+
+      staged.checkpoint.MarkCompleted(value, error);
+      if (error) {
+        return;
+      }
+      staged.context.ReportProgress(entry);
+    }
+
+    if (IsDirToWalk(entry)) {
+      CopyWithCheckpoint(from, value, staged, error);
+      if (error) {
+        return;
+      }
+    }
+  }
+}
+
+bool PerformIncrementalBackupFastPath(
+    const fs::path& from, fs::path to,
+    const std::optional<util::crypto::Key>& key, util::job::Context& context,
+    system::error_code& error) {
   auto [has_full_backup, _] = util::backup::GetLatestFullBackup(to, error);
 
   if (!(error || has_full_backup)) {
-    PerformFullBackup(from, std::move(to), error);
+    PerformFullBackup(from, std::move(to), key, context, error);
   } else if (error) {
     util::format::PrintError("Error while checking {} emptiness\n",
                              to.generic_string());
@@ -111,17 +365,27 @@ bool PerformIncrementalBackupFastPath(const fs::path& from, fs::path to,
   return !(error || has_full_backup);
 }
 
-BackupTree GetLatestFullBackupDirTree(const fs::path& latest_backup,
-                                      system::error_code& error) {
+// Indexes the latest full backup. Returns nothing if the index outgrows
+// memory_limit bytes, so the caller falls back to merging dir listings
+std::optional<BackupTree> GetLatestFullBackupDirTree(
+    const fs::path& latest_backup, size_t memory_limit,
+    system::error_code& error) {
   BackupTree latest_backup_tree;
+  size_t memory_used = 0;
   const auto& str_backup_path = latest_backup.generic_string();
   const size_t kPathLen = latest_backup.size();
-  for (const auto& entry :
-       fs::recursive_directory_iterator{latest_backup, error}) {
-    const auto& str_path = entry.path().generic_string();
+  for (auto it = fs::recursive_directory_iterator{latest_backup, error};
+       !error && it != fs::recursive_directory_iterator{};
+       it.increment(error)) {
+    const auto& str_path = it->path().generic_string();
     std::string key{std::ranges::mismatch(str_backup_path, str_path).in2,
                     str_path.begin() + str_path.rfind('/') + 1};
 
+    memory_used += key.size() + str_path.size() - kPathLen + kIndexEntryOverhead;
+    if (memory_used > memory_limit) {
+      return std::nullopt;
+    }
+
     latest_backup_tree[std::move(key)].emplace(str_path, kPathLen);
   }
 
@@ -170,35 +434,53 @@ auto GetEntryAndBackupEntryWriteTime(
   return {entry_time, backup_entry_time};
 }
 
-void PerformIncrementalCopy(std::string_view entry, fs::path& to,
-                            std::string value,
+void PerformIncrementalCopy(const std::string& entry, StagedBackup& staged,
+                            const std::string& value,
                             const fs::file_status& entry_stat,
-                            bool& should_create_backup_dir,
                             system::error_code& error) {
-  if (should_create_backup_dir) {
-    CreateSubdirForBackup(to, error);
-    if (error) {
-      return;
-    }
-    should_create_backup_dir = false;
-  }
-
-  fs::path dest{to.generic_string() + std::move(value)};
-  if (entry_stat.type() != fs::file_type::directory_file) {
-    dest.remove_filename();
-  }
-
-  CreateDirs(dest, error);
+  // The entry is copied under its snapshot name, which is not always its own
+  fs::path dest = staged.dir / util::backup::GetSnapshotValue(value);
+  bool is_dir = entry_stat.type() == fs::file_type::directory_file;
+  CreateDirs(is_dir ? dest : dest.parent_path(), error);
   if (error) {
     return;
   }
-  util::filesystem::CopyFromTo(entry, dest, error, fs::copy_options::recursive);
+
+  // A resumed run may find a part of the entry copied already
+  const auto kOptions =
+      fs::copy_options::recursive | fs::copy_options::overwrite_existing;
+  if (is_dir) {
+    // The entries of the dir that fail are reported one by one
+    util::filesystem::CopyTree(entry, dest, kOptions, staged.GetCipher(),
+                               util::filesystem::Attributes::kCopy,
+                               staged.context, error);
+  } else {
+    util::filesystem::CopyFromTo(entry, dest, error, kOptions,
+                                 staged.GetCipher(),
+                                 util::filesystem::Attributes::kCopy);
+  }
 }
 
 bool ShouldBackup(std::string_view entry, std::string_view backup_entry,
                   const fs::file_status& entry_stat,
-                  const fs::file_status& backup_entry_stat,
+                  const fs::file_status& backup_entry_stat, bool is_encrypted,
                   system::error_code& error) {
+  if (backup_entry_stat.type() == entry_stat.type() &&
+      entry_stat.type() == fs::file_type::symlink_file) {
+    auto target = fs::read_symlink(std::string{entry}, error);
+    if (error) {
+      util::format::PrintError("Error while reading symlink {}\n", entry);
+      return false;
+    }
+    auto backup_target = fs::read_symlink(std::string{backup_entry}, error);
+    if (error) {
+      util::format::PrintError("Error while reading symlink {}\n",
+                               backup_entry);
+      return false;
+    }
+    return target != backup_target;
+  }
+
   if (backup_entry_stat.type() == entry_stat.type()) {
     auto [entry_time, backup_entry_time] =
         GetEntryAndBackupEntryWriteTime(entry, backup_entry, error);
@@ -210,6 +492,9 @@ bool ShouldBackup(std::string_view entry, std::string_view backup_entry,
     if (entry_time <= backup_entry_time) {
       auto [entry_sz, backup_entry_sz] =
           GetEntryAndBackupEntrySize(entry, backup_entry, error);
+      if (is_encrypted) {
+        entry_sz = util::crypto::GetEncryptedSize(entry_sz);
+      }
       if (error || entry_sz == backup_entry_sz) {
         return false;
       }
@@ -219,82 +504,228 @@ bool ShouldBackup(std::string_view entry, std::string_view backup_entry,
   return true;
 }
 
-void ProcessEntries(const fs::path& from, fs::path& to,
-                    const fs::path& latest_backup,
-                    BackupTree& latest_backup_tree, system::error_code& error) {
-  bool should_create_backup_dir = true;
-  const size_t kFromLen = from.generic_string().size();
+bool CopyEntryIfChanged(const std::string& entry, const std::string& value,
+                        const fs::file_status& entry_stat, bool is_in_backup,
+                        const fs::path& latest_backup, StagedBackup& staged,
+                        system::error_code& error) {
+  if (is_in_backup) {
+    std::string backup_entry =
+        latest_backup.generic_string() + util::backup::GetSnapshotValue(value);
+    auto backup_entry_stat = fs::symlink_status(backup_entry, error);
+    if (error) {
+      util::format::PrintError("Error while getting info on {}\n",
+                               backup_entry);
+      return false;
+    }
 
-  for (auto it = fs::recursive_directory_iterator{from, error};
-       it != fs::recursive_directory_iterator{}; ++it) {
-    const auto& entry = it->path().generic_string();
-    std::string key{std::ranges::mismatch(from.generic_string(), entry).in2,
-                    entry.begin() + entry.rfind('/') + 1};
+    if (!ShouldBackup(entry, backup_entry, entry_stat, backup_entry_stat,
+                      staged.cipher.has_value(), error)) {
+      return false;
+    }
+    if (error) {
+      return false;
+    }
+  }
 
-    auto entry_stat = fs::status(entry, error);
+  PerformIncrementalCopy(entry, staged, value, entry_stat, error);
+  if (error) {
+    return false;
+  }
+
+  CaptureMetadataTree(entry, value, entry_stat, staged, error);
+  return !error;
+}
+
+// Copies the entry into the staging dir unless it is unchanged since the
+// latest full backup. Returns whether the entry has been copied. A failed
+// entry is reported to the job and only cancellation or a broken journal
+// stop the run
+bool ProcessEntry(const std::string& entry, std::string value,
+                  const fs::file_status& entry_stat, bool is_in_backup,
+                  const fs::path& latest_backup, StagedBackup& staged,
+                  system::error_code& error) {
+  system::error_code entry_error;
+  bool is_copied = CopyEntryIfChanged(entry, value, entry_stat, is_in_backup,
+                                      latest_backup, staged, entry_error);
+  if (staged.context.CheckCancelled(error)) {
+    return false;
+  }
+  if (entry_error) {
+    staged.context.ReportFileError(entry, entry_error);
+    return false;
+  }
+
+  if (is_copied) {
+    staged.checkpoint.MarkCompleted(std::move(value), error);
     if (error) {
-      util::format::PrintError("Error while getting info on {}\n", entry);
+      return false;
+    }
+  }
+
+  // A copied dir is reported entry by entry by CopyTree
+  if (!is_copied || entry_stat.type() != fs::file_type::directory_file) {
+    staged.context.ReportProgress(entry);
+  }
+  return is_copied;
+}
+
+// Walks the subtree of the source dir in the same order as
+// CopyWithCheckpoint. If the latest full backup is indexed, the entries of a
+// dir are looked up in the index. Otherwise they are looked up in the sorted
+// listing of the backup copy of the dir, so only the dirs on the current path
+// are held
+void ProcessEntries(const fs::path& from, const std::string& dir_value,
+                    const fs::path& latest_backup,
+                    const BackupTree* latest_backup_tree, StagedBackup& staged,
+                    system::error_code& error) {
+  auto names = ListSourceDir(from, dir_value, staged, error);
+  if (error) {
+    return;
+  }
+
+  auto backup_dir_value = util::backup::GetSnapshotValue(dir_value);
+  const std::unordered_set<std::string>* backup_values = nullptr;
+  std::vector<std::string> backup_names;
+  if (latest_backup_tree) {
+    auto values_it = latest_backup_tree->find(backup_dir_value + '/');
+    if (values_it != latest_backup_tree->end()) {
+      backup_values = &values_it->second;
+    }
+  } else {
+    system::error_code dir_error;
+    backup_names = GetSortedDirEntries(
+        latest_backup.generic_string() + backup_dir_value, dir_error);
+    if (dir_error) {
+      staged.context.ReportFileError(from.generic_string() + dir_value,
+                                     dir_error);
       return;
     }
+  }
+
+  for (const auto& name : names) {
+    // A name escaped at the root of the snapshot may sort apart from its
+    // source name, so the listing is searched rather than merged
+    std::string value = dir_value + '/' + name;
+    auto backup_value = util::backup::GetSnapshotValue(value);
+    bool is_in_backup =
+        latest_backup_tree
+            ? backup_values && backup_values->contains(backup_value)
+            : std::ranges::binary_search(
+                  backup_names,
+                  backup_value.substr(backup_dir_value.size() + 1));
+
+    // A journaled entry has been copied with all its subtree
+    auto state = staged.checkpoint.GetState(value);
+    if (state == util::backup::PathState::kCompleted ||
+        state == util::backup::PathState::kLast) {
+      continue;
+    }
 
-    std::string value(entry, kFromLen);
-    if (latest_backup_tree[std::move(key)].contains(value)) {
-      std::string backup_entry = latest_backup.generic_string() + value;
-      auto backup_entry_stat = fs::status(backup_entry, error);
+    std::string entry = from.generic_string() + value;
+    bool is_copied = false;
+    if (state == util::backup::PathState::kPending) {
+      system::error_code entry_error;
+      auto entry_stat = fs::symlink_status(entry, entry_error);
+      if (entry_error) {
+        staged.context.ReportFileError(entry, entry_error);
+        continue;
+      }
+
+      is_copied = ProcessEntry(entry, value, entry_stat, is_in_backup,
+                               latest_backup, staged, error);
       if (error) {
-        util::format::PrintError("Error while getting info on {}\n",
-                                 backup_entry);
         return;
       }
+    }
 
-      if (!ShouldBackup(entry, backup_entry, entry_stat, backup_entry_stat,
-                        error)) {
-        continue;
-      }
+    if (!is_copied && IsDirToWalk(entry)) {
+      ProcessEntries(from, value, latest_backup, latest_backup_tree, staged,
+                     error);
       if (error) {
         return;
       }
     }
+  }
+}
 
-    PerformIncrementalCopy(entry, to, std::move(value), entry_stat,
-                           should_create_backup_dir, error);
+void FinishIncrementalBackup(const fs::path& to, StagedBackup& staged,
+                             system::error_code& error) {
+  if (staged.checkpoint.IsEmpty()) {
+    fs::remove_all(staged.dir, error);
     if (error) {
+      util::format::PrintError("Error while deleting dir {}\n",
+                               staged.dir.generic_string());
       return;
     }
 
-    if (entry_stat.type() == fs::file_type::directory_file) {
-      it.disable_recursion_pending();
-    }
+    util::format::PrintInfo(
+        "The diff to the latest full backup is empty. Backup is not "
+        "created. To force its creation, provide -f flag instead of -i.\n");
+    return;
   }
 
+  staged.metadata_writer.Flush(error);
   if (error) {
-    util::format::PrintError("Error while iterating through dir {}\n",
-                             from.generic_string());
-  } else if (should_create_backup_dir) {
-    fmt::print(fmt::fg(fmt::color::sky_blue),
-               "The diff to the latest full backup is empty. Backup is not "
-               "created. To force its creation, provide -f flag instead of -i.\n");
+    return;
+  }
+  auto new_backup = CommitBackup(staged.dir, to, error);
+  if (error) {
+    return;
   }
+  staged.checkpoint.Remove(new_backup, error);
 }
 
 } // namespace
 
-void PerformFullBackup(const fs::path& from, fs::path to, system::error_code& error) {
-  CreateSubdirForBackup(to, error);
+void PerformFullBackup(const fs::path& from, fs::path to,
+                       const std::optional<util::crypto::Key>& key,
+                       util::job::Context& context, system::error_code& error) {
+  CheckIsBackupRoot(to, error);
+  if (error) {
+    return;
+  }
+
+  auto base = ComposeCheckpointBase(from, {}, key, error);
+  if (error) {
+    return;
+  }
+
+  const bool kIsFull = true;
+  StagedBackup staged{util::backup::GetStagingDir(to, kIsFull), base, key,
+                      context, error};
+  if (error) {
+    return;
+  }
+
+  CopyWithCheckpoint(from, {}, staged, error);
   if (error) {
     return;
   }
 
-  util::filesystem::CopyFromTo(from, to, error, fs::copy_options::recursive);
-  fs::path new_backup_folder = to.filename();
-  util::backup::UpdateLatestFullBackup(to.parent_path(), to.generic_string());
-  util::backup::MarkAsFullBackup(to);
+  util::backup::MarkAsFullBackup(staged.dir);
+  staged.metadata_writer.Flush(error);
+  if (error) {
+    return;
+  }
+
+  auto new_backup = CommitBackup(staged.dir, to, error);
+  if (error) {
+    return;
+  }
+  staged.checkpoint.Remove(new_backup, error);
+  if (error) {
+    return;
+  }
+  util::backup::UpdateLatestFullBackup(to, new_backup.generic_string(), error);
 }
 
 void PerformIncrementalBackup(const fs::path& from, fs::path to,
+                              size_t memory_limit,
+                              const std::optional<util::crypto::Key>& key,
+                              util::job::Context& context,
                               system::error_code& error) {
   bool is_fast_path_performed =
-      PerformIncrementalBackupFastPath(from, to, error);
+      PerformIncrementalBackupFastPath(from, to, key, context, error);
   if (error || is_fast_path_performed) {
     return;
   }
@@ -304,12 +735,49 @@ void PerformIncrementalBackup(const fs::path& from, fs::path to,
     return;
   }
 
-  auto latest_backup_tree = GetLatestFullBackupDirTree(latest_backup, error);
+  // An increment is only restored together with its full backup, so both
+  // must be readable with the same key
+  if (util::backup::ReadKeyId(latest_backup) != GetKeyId(key)) {
+    error = system::errc::make_error_code(system::errc::invalid_argument);
+    util::format::PrintError(
+        "The latest full backup {} is made with another key. Use the same key "
+        "or make a full backup\n",
+        latest_backup.generic_string());
+    return;
+  }
+
+  auto latest_backup_tree =
+      GetLatestFullBackupDirTree(latest_backup, memory_limit, error);
+  if (error) {
+    return;
+  }
+
+  auto base = ComposeCheckpointBase(from, latest_backup.generic_string(), key,
+                                    error);
+  if (error) {
+    return;
+  }
+
+  const bool kIsFull = false;
+  StagedBackup staged{util::backup::GetStagingDir(to, kIsFull), base, key,
+                      context, error};
+  if (error) {
+    return;
+  }
+
+  if (!latest_backup_tree) {
+    util::format::PrintInfo(
+        "The latest full backup does not fit into the memory limit. "
+        "Comparing it directory by directory.\n");
+  }
+  ProcessEntries(from, {}, latest_backup,
+                 latest_backup_tree ? &*latest_backup_tree : nullptr, staged,
+                 error);
   if (error) {
     return;
   }
 
-  ProcessEntries(from, to, latest_backup, latest_backup_tree, error);
+  FinishIncrementalBackup(to, staged, error);
 }
 
 } // namespace backup
\ No newline at end of file
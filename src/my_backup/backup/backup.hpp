@@ -1,5 +1,10 @@
 #pragma once
 
+#include "../../util/crypto/cipher.hpp"
+#include "../../util/job/context.hpp"
+
+#include <optional>
+
 #include <boost/filesystem.hpp>
 #include <boost/system/error_code.hpp>
 
@@ -10,8 +15,13 @@ namespace fs = boost::filesystem;
 namespace system = boost::system;
 } // namespace
 
-void PerformFullBackup(const fs::path& from, fs::path to, system::error_code& error);
+// The entries that fail to be copied are reported to the context and
+// skipped. The error is set if the run can not go on or is cancelled. With a
+// key the file contents are encrypted, the names and metadata are not
+void PerformFullBackup(const fs::path& from, fs::path to, const std::optional<util::crypto::Key>& key, util::job::Context& context, system::error_code& error);
 
-void PerformIncrementalBackup(const fs::path& from, fs::path to, system::error_code& error);
+// The index of the latest full backup is kept within memory_limit bytes.
+// Bigger backups are compared with the source directory by directory
+void PerformIncrementalBackup(const fs::path& from, fs::path to, size_t memory_limit, const std::optional<util::crypto::Key>& key, util::job::Context& context, system::error_code& error);
 
 } // namespace backup
\ No newline at end of file
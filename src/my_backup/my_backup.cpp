@@ -1,11 +1,21 @@
 #include "backup/backup.hpp"
+#include "../libbackuper/scheduler.hpp"
 #include "../options/options.hpp"
+#include "../util/crypto/cipher.hpp"
 #include "../util/format.hpp"
+#include "../util/job/context.hpp"
 
+#include <fstream>
+#include <iomanip>
 #include <iostream>
+#include <limits>
+#include <optional>
+#include <set>
+#include <sstream>
 
 #include <fmt/color.h>
 
+#include <boost/filesystem.hpp>
 #include <boost/program_options/errors.hpp>
 #include <boost/program_options/options_description.hpp>
 #include <boost/program_options/variables_map.hpp>
@@ -13,6 +23,98 @@
 
 namespace po = boost::program_options;
 
+namespace {
+
+void PrintFileErrors(const std::vector<util::job::FileError>& file_errors) {
+  for (const auto& [path, file_error] : file_errors) {
+    util::format::PrintError("Skipped {}: {}\n", path, file_error.message());
+  }
+}
+
+// Every line of a manifest is a pair of paths, quoted if they have spaces:
+// what to back up and where to. Empty lines and lines starting with # are
+// skipped. Backups are named by the time they are made, so two lines with
+// the same destination would overwrite each other and are not allowed. The
+// rest of the job options are shared by all the lines
+bool ReadManifest(const std::string& manifest,
+                  const backuper::JobOptions& shared_options,
+                  backuper::Scheduler& scheduler) {
+  std::ifstream file{manifest};
+  if (!file) {
+    util::format::PrintError("Error while opening manifest {}\n", manifest);
+    return false;
+  }
+
+  std::set<boost::filesystem::path> destinations;
+  std::string line;
+  for (size_t line_number = 1; std::getline(file, line); ++line_number) {
+    std::istringstream record{line};
+    record >> std::ws;
+    if (record.eof() || record.peek() == '#') {
+      continue;
+    }
+
+    std::string from;
+    std::string to;
+    if (!(record >> std::quoted(from) >> std::quoted(to))) {
+      util::format::PrintError("Malformed line {} of manifest {}\n",
+                               line_number, manifest);
+      return false;
+    }
+
+    boost::system::error_code error;
+    auto destination =
+        boost::filesystem::weakly_canonical(boost::filesystem::absolute(to),
+                                            error);
+    if (error) {
+      util::format::PrintError("Error while resolving {}: {}\n", to,
+                               error.message());
+      return false;
+    }
+    if (!destinations.insert(destination).second) {
+      util::format::PrintError("Destination {} on line {} of manifest {} is "
+                               "already used\n",
+                               to, line_number, manifest);
+      return false;
+    }
+
+    auto options = shared_options;
+    options.from = std::move(from);
+    options.to = std::move(to);
+    scheduler.Add(std::move(options));
+  }
+
+  return true;
+}
+
+int PerformManifestBackup(const po::variables_map& opt_map,
+                          const backuper::JobOptions& shared_options) {
+  backuper::Scheduler scheduler{opt_map[options::kJobs].as<size_t>(),
+                                opt_map[options::kDeviceJobs].as<size_t>()};
+  if (!ReadManifest(opt_map[options::kManifest].as<std::string>(),
+                    shared_options, scheduler)) {
+    return 1;
+  }
+
+  int exit_code = 0;
+  for (const auto& [job, error, file_errors] : scheduler.Run()) {
+    if (error) {
+      util::format::PrintError("Backup of {} to {} failed: {}\n",
+                               job.from.generic_string(),
+                               job.to.generic_string(), error.message());
+      exit_code = 1;
+    }
+    PrintFileErrors(file_errors);
+    if (!file_errors.empty()) {
+      exit_code = 1;
+    }
+  }
+
+  return exit_code;
+}
+
+} // namespace
+
 int main(int argc, char* argv[]) {
   po::variables_map opt_map;
   po::options_description help;
@@ -32,26 +134,69 @@ int main(int argc, char* argv[]) {
     return 1;
   }
 
+  if (opt_map.count(options::kHelp)) {
+    std::cout << std::move(help);
+    return 0;
+  }
+
+  const bool kHasManifest = opt_map.count(options::kManifest) == 1;
+  const bool kHasDirs =
+      opt_map.count(options::kFrom) == 1 && opt_map.count(options::kTo) == 1;
+  if (kHasManifest == kHasDirs) {
+    util::format::PrintError(
+        "Error while parsing command: provide either <from> <to> or "
+        "--{}\n",
+        options::kManifest);
+    return 1;
+  }
+
   const bool kIsFull = opt_map.count(options::kFull) == 1;
   const bool kIsIncrement = opt_map.count(options::kIncrement) == 1;
-  std::string from = opt_map[options::kFrom].as<std::string>();
-  std::string to = opt_map[options::kTo].as<std::string>();
+  const size_t kMiB = 1 << 20;
+  size_t memory_limit = std::numeric_limits<size_t>::max();
+  if (opt_map.count(options::kMemoryLimit)) {
+    memory_limit = opt_map[options::kMemoryLimit].as<size_t>() * kMiB;
+  }
+
+  if (kIsFull && kIsIncrement) {
+    util::format::PrintError("You should use --full or --increment, not both\n");
+    return 1;
+  }
+  if (!kIsFull && !kIsIncrement) {
+    fmt::print(fmt::fg(fmt::color::sky_blue),
+               "Performing full backup due to unspecified options\n");
+  }
 
   boost::system::error_code error;
-  if (kIsFull == kIsIncrement) {
-    if (kIsFull) {
-      util::format::PrintError(
-          "You should use --full or --increment, not both\n");
+  std::optional<util::crypto::Key> key;
+  if (opt_map.count(options::kKeyFile)) {
+    key = util::crypto::ReadKey(opt_map[options::kKeyFile].as<std::string>(),
+                                error);
+    if (error) {
       return 1;
     }
+  }
 
-    fmt::print(fmt::fg(fmt::color::sky_blue),
-               "Performing full backup due to unspecified options\n");
-    backup::PerformFullBackup(from, std::move(to), error);
-  } else if (kIsFull) {
-    backup::PerformFullBackup(from, std::move(to), error);
-  } else {
-    backup::PerformIncrementalBackup(from, std::move(to), error);
+  if (kHasManifest) {
+    auto kind = kIsIncrement ? backuper::JobKind::kIncrementalBackup
+                             : backuper::JobKind::kFullBackup;
+    return PerformManifestBackup(opt_map, {kind, {}, {}, memory_limit, key});
+  }
+
+  std::string from = opt_map[options::kFrom].as<std::string>();
+  std::string to = opt_map[options::kTo].as<std::string>();
+
+  util::job::Context context{{}};
+  try {
+    if (kIsIncrement) {
+      backup::PerformIncrementalBackup(from, std::move(to), memory_limit, key,
+                                       context, error);
+    } else {
+      backup::PerformFullBackup(from, std::move(to), key, context, error);
+    }
+  } catch (const std::exception& e) {
+    util::format::PrintError("Error: {}\n", e.what());
+    return 1;
   }
 
   if (error) {
@@ -59,5 +204,8 @@ int main(int argc, char* argv[]) {
     return 1;
   }
 
-  return 0;
+  auto file_errors = context.GetFileErrors();
+  PrintFileErrors(file_errors);
+
+  return file_errors.empty() ? 0 : 1;
 }
\ No newline at end of file
@@ -1,8 +1,11 @@
 #include "../options/options.hpp"
+#include "../util/crypto/cipher.hpp"
 #include "../util/format.hpp"
+#include "../util/job/context.hpp"
 #include "restore/restore.hpp"
 
 #include <iostream>
+#include <optional>
 
 #include <boost/program_options.hpp>
 #include <boost/program_options/errors.hpp>
@@ -36,9 +39,18 @@ int main(int argc, char* argv[]) {
   std::string to = opt_map[options::kTo].as<std::string>();
 
   boost::system::error_code error;
+  std::optional<util::crypto::Key> key;
+  if (opt_map.count(options::kKeyFile)) {
+    key = util::crypto::ReadKey(opt_map[options::kKeyFile].as<std::string>(), error);
+    if (error) {
+      return 1;
+    }
+  }
+
+  util::job::Context context{{}};
   try {
-    restore::Restore(std::move(from), to, error);
-  } catch (const std::logic_error& e) {
+    restore::Restore(std::move(from), to, key, context, error);
+  } catch (const std::exception& e) {
     util::format::PrintError("{}\n", e.what());
     return 1;
   }
@@ -47,4 +59,11 @@ int main(int argc, char* argv[]) {
     util::format::PrintError("{}\n", error.what());
     return 1;
   }
+
+  auto file_errors = context.GetFileErrors();
+  for (const auto& [path, file_error] : file_errors) {
+    util::format::PrintError("Skipped {}: {}\n", path, file_error.message());
+  }
+
+  return file_errors.empty() ? 0 : 1;
 }
\ No newline at end of file
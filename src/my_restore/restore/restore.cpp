@@ -1,6 +1,9 @@
 #include "restore.hpp"
 #include "../../util/backup/full_backup.hpp"
+#include "../../util/backup/snapshot.hpp"
+#include "../../util/crypto/cipher.hpp"
 #include "../../util/filesystem/copy.hpp"
+#include "../../util/filesystem/metadata.hpp"
 #include "../../util/format.hpp"
 
 #include <boost/filesystem/operations.hpp>
@@ -17,16 +20,60 @@ namespace system = boost::system;
 
 const auto kDefaultOptions = fs::copy_options::recursive | fs::copy_options::overwrite_existing;
 
-void DeleteMetadata(const fs::path& to, system::error_code& error) {
-  util::backup::UnmarkAsFullBackup(to, error);
+// The permissions and timestamps come from the metadata tables, applied once
+// all the data is written
+const auto kAttributes = util::filesystem::Attributes::kSkip;
+
+// Applies the metadata tables of the snapshots in one pass once all the data
+// is in place. Later snapshots override the records of the earlier ones
+void RestoreMetadata(std::initializer_list<fs::path> snapshots, const fs::path& to, system::error_code& error) {
+  util::filesystem::MetadataTable table;
+  for (const auto& snapshot : snapshots) {
+    util::filesystem::LoadMetadataTable(util::backup::GetServiceDir(snapshot), table, error);
+    if (error) {
+      return;
+    }
+  }
+
+  util::filesystem::ApplyMetadataTable(to, table, error);
 }
 
-bool RestoreFastPath(const fs::path& from, const fs::path& to, system::error_code& error) {
+// Copies the data of a snapshot into the dir, leaving its service dir out
+void CopySnapshot(const fs::path& from, const fs::path& to, const util::crypto::Cipher* cipher, util::job::Context& context, system::error_code& error) {
+  fs::create_directories(to, error);
+  if (error) {
+    util::format::PrintError("Error while creating dir {}\n", to.generic_string());
+    return;
+  }
+
+  for (const auto& entry : fs::directory_iterator{from, error}) {
+    if (util::backup::IsServiceDir(entry.path())) {
+      continue;
+    }
+    util::filesystem::CopyTree(entry.path(), to / util::backup::GetSourceName(entry.path()), kDefaultOptions, cipher, kAttributes, context, error);
+    if (error) {
+      return;
+    }
+  }
+
+  if (error) {
+    util::format::PrintError("Error while iterating through dir {}\n", from.generic_string());
+  }
+}
+
+void CheckKeyId(const fs::path& snapshot, const std::string& key_id, system::error_code& error) {
+  if (util::backup::ReadKeyId(snapshot) != key_id) {
+    error = system::errc::make_error_code(system::errc::invalid_argument);
+    util::format::PrintError("Backup {} is made with another key\n", snapshot.generic_string());
+  }
+}
+
+bool RestoreFastPath(const fs::path& from, const fs::path& to, const util::crypto::Cipher* cipher, util::job::Context& context, system::error_code& error) {
   bool is_full_backup = util::backup::CheckIsFullBackup(from, error);
   if (is_full_backup) {
-    util::filesystem::CopyFromTo(from, to, error, kDefaultOptions);
+    CopySnapshot(from, to, cipher, context, error);
     if (!error) {
-      DeleteMetadata(to, error);
+      RestoreMetadata({from}, to, error);
     }
   }
   return !error && is_full_backup;
@@ -38,6 +85,10 @@ fs::path GetLatestFullBackup(const fs::path& from, const fs::path& parent_from,
     latest_full_backup = std::move(globally_latest_fb);
   } else {
     for (const auto& entry : fs::directory_iterator{parent_from, error}) {
+      // Hidden entries are service files and unfinished (staging) backups
+      if (entry.path().filename().generic_string().starts_with('.')) {
+        continue;
+      }
       if (latest_full_backup < entry && entry < from && util::backup::CheckIsFullBackup(entry, error)) {
         latest_full_backup = entry;
       }
@@ -55,40 +106,44 @@ fs::path GetLatestFullBackup(const fs::path& from, const fs::path& parent_from,
   return latest_full_backup;
 }
 
-void CopyFromToOverwriteDirs(const fs::path& from, const fs::path& to, fs::copy_options options, system::error_code& error) {
-  for (const auto& entry : fs::directory_iterator{from, error}) {
-    if (fs::is_regular_file(entry, error)) {
-      const auto file_options = fs::copy_options::skip_existing | fs::copy_options::update_existing | fs::copy_options::overwrite_existing;
-      fs::copy_file(entry, to / entry.path().filename(), options & file_options, error);
-      if (error) {
-        util::format::PrintError("Error while copying {} to {}\n", entry.path().generic_string(), to.generic_string());
-        break;
-      }
-    } else if (!error && fs::is_directory(entry, error)) {
-      auto dest = to / entry.path().filename();
-      if (!fs::exists(dest, error) && error.value() == system::errc::no_such_file_or_directory) {
-        error.clear();
-        util::filesystem::CopyFromTo(entry, dest, error, options & fs::copy_options::recursive);
-        if (error) {
-          break;
-        }
-      } else if (error) {
-        util::format::PrintError("Error while checking {} existence\n", dest.generic_string());
-        break;
-      }
+void CopyEntryOverwriteDirs(const fs::directory_entry& entry, const fs::path& to, fs::copy_options options, const util::crypto::Cipher* cipher, util::job::Context& context, system::error_code& error) {
+  auto dest = to / util::backup::GetSourceName(entry.path());
+  auto type = fs::symlink_status(entry.path(), error).type();
+  if (!error && type != fs::file_type::directory_file) {
+    const auto file_options = fs::copy_options::skip_existing | fs::copy_options::update_existing | fs::copy_options::overwrite_existing;
+    util::filesystem::CopyFromTo(entry.path(), dest, error, options & file_options, cipher, kAttributes);
+    if (error) {
+      util::format::PrintError("Error while copying {} to {}\n", entry.path().generic_string(), to.generic_string());
+      return;
+    }
+    context.ReportProgress(entry.path());
+  } else if (!error) {
+    fs::remove_all(dest, error);
+    if (error) {
+      util::format::PrintError("Error while removing dir {}\n", dest.generic_string());
+      return;
+    }
+    util::filesystem::CopyTree(entry, dest, options & fs::copy_options::recursive, cipher, kAttributes, context, error);
+  } else if (error) {
+    util::format::PrintError("Error while checking {} file type\n", entry.path().generic_string());
+  }
+}
 
-      fs::remove_all(dest, error);
-      if (error) {
-        util::format::PrintError("Error while removing dir {}\n", dest.generic_string());
-        break;
-      }
-      util::filesystem::CopyFromTo(entry, dest, error, options & fs::copy_options::recursive);
-      if (error) {
-        break;
-      }
-    } else if (error) {
-      util::format::PrintError("Error while checking {} file type\n", entry.path().generic_string());
-      break;
+// The entries that fail are reported to the context and skipped, the error
+// is only set if the dir can not be read or the job is cancelled. The service
+// dir of the snapshot is left out
+void CopyFromToOverwriteDirs(const fs::path& from, const fs::path& to, fs::copy_options options, const util::crypto::Cipher* cipher, util::job::Context& context, system::error_code& error) {
+  for (const auto& entry : fs::directory_iterator{from, error}) {
+    if (util::backup::IsServiceDir(entry.path())) {
+      continue;
+    }
+    system::error_code entry_error;
+    CopyEntryOverwriteDirs(entry, to, options, cipher, context, entry_error);
+    if (context.CheckCancelled(error)) {
+      return;
+    }
+    if (entry_error) {
+      context.ReportFileError(entry.path(), entry_error);
     }
   }
 
@@ -97,16 +152,28 @@ void CopyFromToOverwriteDirs(const fs::path& from, const fs::path& to, fs::copy_
   }
 }
 
-void CopyFromTo(const fs::path& latest_full_backup, const fs::path& from, const fs::path& to, system::error_code& error) {
-  CopyFromToOverwriteDirs(latest_full_backup, to, kDefaultOptions, error);
+void CopyFromTo(const fs::path& latest_full_backup, const fs::path& from, const fs::path& to, const util::crypto::Cipher* cipher, util::job::Context& context, system::error_code& error) {
+  CopyFromToOverwriteDirs(latest_full_backup, to, kDefaultOptions, cipher, context, error);
   if (error) {
     return;
   }
-  CopyFromToOverwriteDirs(from, to, kDefaultOptions, error);
+  CopyFromToOverwriteDirs(from, to, kDefaultOptions, cipher, context, error);
 }
 
-void RestoreImpl(fs::path from, const fs::path& to, system::error_code& error) {
-  bool fast_path_performed = RestoreFastPath(from, to, error);
+void RestoreImpl(fs::path from, const fs::path& to, const std::optional<util::crypto::Key>& key, util::job::Context& context, system::error_code& error) {
+  std::optional<util::crypto::Cipher> cipher;
+  std::string key_id;
+  if (key) {
+    cipher.emplace(*key, util::crypto::Direction::kDecrypt);
+    key_id = util::crypto::GetKeyId(*key);
+  }
+
+  CheckKeyId(from, key_id, error);
+  if (error) {
+    return;
+  }
+
+  bool fast_path_performed = RestoreFastPath(from, to, cipher ? &*cipher : nullptr, context, error);
   if (error || fast_path_performed) {
     return;
   }
@@ -125,18 +192,22 @@ void RestoreImpl(fs::path from, const fs::path& to, system::error_code& error) {
   if (error) {
     return;
   }
+  CheckKeyId(latest_full_backup, key_id, error);
+  if (error) {
+    return;
+  }
 
-  CopyFromTo(latest_full_backup, from, to, error);
+  CopyFromTo(latest_full_backup, from, to, cipher ? &*cipher : nullptr, context, error);
   if (error) {
     return;
   }
-  DeleteMetadata(to, error);
+  RestoreMetadata({latest_full_backup, from}, to, error);
 }
 
 } // namespace
 
-void Restore(fs::path from, const fs::path& to, system::error_code& error) {
-  RestoreImpl(std::move(from), to, error);
+void Restore(fs::path from, const fs::path& to, const std::optional<util::crypto::Key>& key, util::job::Context& context, system::error_code& error) {
+  RestoreImpl(std::move(from), to, key, context, error);
 }
 
 } // namespace restore
\ No newline at end of file
@@ -1,5 +1,10 @@
 #pragma once
 
+#include "../../util/crypto/cipher.hpp"
+#include "../../util/job/context.hpp"
+
+#include <optional>
+
 #include <boost/filesystem.hpp>
 #include <boost/system/error_code.hpp>
 
@@ -9,6 +14,9 @@ namespace {
 namespace fs = boost::filesystem;
 } // namespace
 
-void Restore(fs::path from, const fs::path& to, boost::system::error_code& error);
+// The entries that fail to be restored are reported to the context and
+// skipped. The error is set if the run can not go on or is cancelled. The key
+// must be the one the backups were made with, if any
+void Restore(fs::path from, const fs::path& to, const std::optional<util::crypto::Key>& key, util::job::Context& context, boost::system::error_code& error);
 
 } // namespace restore
\ No newline at end of file
@@ -7,17 +7,23 @@
 #include <boost/program_options/positional_options.hpp>
 #include <boost/program_options/variables_map.hpp>
 #include <string>
+#include <thread>
 
 namespace options {
 
 namespace {
 namespace po = boost::program_options;
 
-po::options_description BuildHiddenOptions(const char* desc_from, const char* desc_to) {
+po::options_description BuildHiddenOptions(const char* desc_from, const char* desc_to, bool is_required) {
+  auto value = [is_required] {
+    auto* value = po::value<std::string>();
+    return is_required ? value->required() : value;
+  };
+
   po::options_description hidden("Hidden options");
   hidden.add_options()
-      (kFrom.c_str(), po::value<std::string>()->required(), desc_from /**/)
-      (kTo.c_str(), po::value<std::string>()->required(), desc_to/**/);
+      (kFrom.c_str(), value(), desc_from /**/)
+      (kTo.c_str(), value(), desc_to/**/);
 
   return hidden;
 }
@@ -30,13 +36,26 @@ auto ConfigureOptions(bool is_backup)
     common.add_options()
         (kHelp.c_str(), "get help message")
         (fmt::format("{},f", kFull).c_str(), "produce full backup")
-        (fmt::format("{},i", kIncrement).c_str(), "produce incremental backup");
+        (fmt::format("{},i", kIncrement).c_str(), "produce incremental backup")
+        (kMemoryLimit.c_str(), po::value<size_t>(), "memory limit for the latest full backup index, MiB. "
+                                                    "Bigger backups are compared directory by directory")
+        (kManifest.c_str(), po::value<std::string>(), "file with a \"<from> <to>\" pair per line to back up "
+                                                     "in one run instead of a single pair of directories")
+        (kJobs.c_str(), po::value<size_t>()->default_value(std::thread::hardware_concurrency()),
+         "number of manifest entries backed up at once")
+        (kDeviceJobs.c_str(), po::value<size_t>()->default_value(1),
+         "number of manifest entries backed up at once to the same device")
+        (kKeyFile.c_str(), po::value<std::string>(), "file with a 32 byte key to encrypt the file contents with");
 
-    hidden.add(BuildHiddenOptions("directory to make backup of", "directory to store backup to"));
+    // The directories are not required, since a manifest may be given instead
+    const bool kIsRequired = false;
+    hidden.add(BuildHiddenOptions("directory to make backup of", "directory to store backup to", kIsRequired));
   } else {
     common.add_options()
-      (kHelp.c_str(), "Usage: ./my_restore <backup-dir> <work-dir>\nExample: ./my_restore backup/2024-01-01_00-00-00 /work");
-    hidden.add(BuildHiddenOptions("directory to obtain backup from", "directory to restore backup to"));
+      (kHelp.c_str(), "Usage: ./my_restore <backup-dir> <work-dir>\nExample: ./my_restore backup/2024-01-01_00-00-00 /work")
+      (kKeyFile.c_str(), po::value<std::string>(), "file with the key the backup was encrypted with");
+    const bool kIsRequired = true;
+    hidden.add(BuildHiddenOptions("directory to obtain backup from", "directory to restore backup to", kIsRequired));
   }
   po::options_description cmd_options;
   cmd_options.add(common).add(hidden);
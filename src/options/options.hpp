@@ -5,10 +5,15 @@
 
 namespace options {
 
+const std::string kDeviceJobs = "device-jobs";
 const std::string kFrom = "from";
 const std::string kFull = "full";
 const std::string kHelp = "help";
 const std::string kIncrement = "increment";
+const std::string kJobs = "jobs";
+const std::string kKeyFile = "key-file";
+const std::string kManifest = "manifest";
+const std::string kMemoryLimit = "memory-limit";
 const std::string kTo = "to";
 
 namespace {
@@ -0,0 +1,220 @@
+#include "../my_backup/backup/backup.hpp"
+#include "../my_restore/restore/restore.hpp"
+#include "../util/format.hpp"
+#include "../util/job/context.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <fmt/format.h>
+
+#include <boost/filesystem.hpp>
+#include <boost/filesystem/fstream.hpp>
+#include <boost/system/error_code.hpp>
+
+// Backs trees of the shapes the backups meet up, restores them and compares
+// the restored trees with the sources. Exits with 1 if any check fails
+
+namespace {
+
+namespace fs = boost::filesystem;
+namespace system = boost::system;
+
+int failures = 0;
+
+void Check(bool condition, std::string_view what) {
+  if (!condition) {
+    fmt::print(stderr, "FAILED: {}\n", what);
+    ++failures;
+  }
+}
+
+void WriteFile(const fs::path& path, std::string_view data) {
+  fs::ofstream file{path, std::ios::binary};
+  file << data;
+}
+
+std::string ReadFile(const fs::path& path) {
+  fs::ifstream file{path, std::ios::binary};
+  return {std::istreambuf_iterator<char>{file}, {}};
+}
+
+bool IsSymlinkTo(const fs::path& path, const fs::path& target) {
+  system::error_code error;
+  return fs::is_symlink(path, error) && fs::read_symlink(path, error) == target;
+}
+
+// A source, the backups made of it and the trees restored from them
+class Sandbox {
+ public:
+  explicit Sandbox(std::string_view name)
+      : dir_{fs::temp_directory_path() /
+             fs::unique_path(fmt::format("backup_test-{}-%%%%-%%%%", name))} {
+    fs::create_directories(GetSource());
+    fs::create_directories(dir_ / "backups");
+  }
+
+  Sandbox(const Sandbox&) = delete;
+  Sandbox& operator=(const Sandbox&) = delete;
+
+  ~Sandbox() {
+    system::error_code error;
+    fs::remove_all(dir_, error);
+  }
+
+  fs::path GetSource() const {
+    return dir_ / "source";
+  }
+
+  void Backup(bool is_full, std::string_view what) {
+    // Backups are named by the second they are made in
+    std::this_thread::sleep_for(std::chrono::milliseconds{1100});
+    util::job::Context context{{}};
+    system::error_code error;
+    if (is_full) {
+      backup::PerformFullBackup(GetSource(), dir_ / "backups", {}, context,
+                                error);
+    } else {
+      backup::PerformIncrementalBackup(GetSource(), dir_ / "backups",
+                                       SIZE_MAX, {}, context, error);
+    }
+    Check(!error && context.GetFileErrors().empty(),
+          fmt::format("{}: backed up", what));
+  }
+
+  // Restores the latest backup into a new dir
+  fs::path Restore(std::string_view what) {
+    std::vector<fs::path> snapshots;
+    for (const auto& entry : fs::directory_iterator{dir_ / "backups"}) {
+      if (entry.path().filename().string().front() != '.') {
+        snapshots.push_back(entry.path());
+      }
+    }
+    std::ranges::sort(snapshots);
+
+    auto out = dir_ / fmt::format("restored{}", restores_++);
+    fs::create_directories(out);
+    util::job::Context context{{}};
+    system::error_code error;
+    restore::Restore(snapshots.back(), out, {}, context, error);
+    Check(!error && context.GetFileErrors().empty(),
+          fmt::format("{}: restored", what));
+    return out;
+  }
+
+ private:
+  fs::path dir_;
+  int restores_ = 0;
+};
+
+// Symlinks are kept as symlinks: a link to a dir does not turn into a copy
+// or an empty dir, and a link to its own dir does not make the walk loop
+void TestSymlinks() {
+  Sandbox sandbox{"symlinks"};
+  auto source = sandbox.GetSource();
+  fs::create_directories(source / "real");
+  WriteFile(source / "real" / "file", "data");
+  fs::create_symlink("real", source / "dir_link");
+  fs::create_symlink("real/file", source / "file_link");
+  fs::create_symlink("nowhere", source / "dangling");
+  fs::create_symlink("..", source / "real" / "loop");
+
+  sandbox.Backup(true, "symlinks");
+  auto out = sandbox.Restore("symlinks");
+  Check(ReadFile(out / "real" / "file") == "data", "symlinks: file");
+  Check(IsSymlinkTo(out / "dir_link", "real"), "symlinks: link to dir");
+  Check(IsSymlinkTo(out / "file_link", "real/file"), "symlinks: link to file");
+  Check(IsSymlinkTo(out / "dangling", "nowhere"), "symlinks: dangling link");
+  Check(IsSymlinkTo(out / "real" / "loop", ".."), "symlinks: looping link");
+
+  // An increment picks up a link pointed elsewhere
+  fs::remove(source / "dir_link");
+  fs::create_symlink("real/file", source / "dir_link");
+  sandbox.Backup(false, "retargeted symlink");
+  out = sandbox.Restore("retargeted symlink");
+  Check(IsSymlinkTo(out / "dir_link", "real/file"),
+        "retargeted symlink: new target");
+  Check(IsSymlinkTo(out / "file_link", "real/file"),
+        "retargeted symlink: other links kept");
+}
+
+// Names are arbitrary bytes, so a newline in one must not break the line
+// based metadata table and drop the metadata of the whole restore
+void TestNewlines() {
+  Sandbox sandbox{"newlines"};
+  auto source = sandbox.GetSource();
+  fs::create_directories(source / "new\nline");
+  WriteFile(source / "new\nline" / "we\nird", "data");
+  fs::permissions(source / "new\nline" / "we\nird", fs::perms::owner_read);
+  WriteFile(source / "plain", "plain");
+  fs::permissions(source / "plain", fs::perms::owner_all);
+  fs::last_write_time(source / "plain", 1000000000);
+
+  sandbox.Backup(true, "newlines");
+  auto out = sandbox.Restore("newlines");
+  Check(ReadFile(out / "new\nline" / "we\nird") == "data", "newlines: file");
+  Check(fs::status(out / "new\nline" / "we\nird").permissions() ==
+            fs::perms::owner_read,
+        "newlines: mode of the file");
+  Check(fs::status(out / "plain").permissions() == fs::perms::owner_all,
+        "newlines: mode of a neighbour");
+  Check(fs::last_write_time(out / "plain") == 1000000000,
+        "newlines: time of a neighbour");
+}
+
+// Source entries named like the files a snapshot keeps about itself are
+// backed up and restored as any other data
+void TestReservedNames() {
+  Sandbox sandbox{"reserved"};
+  auto source = sandbox.GetSource();
+  const std::vector<std::string> kNames = {
+      ".backup_metadata", ".checkpoint", ".encrypted", ".full_backup",
+      ".backuper~",       ".backuper.x", ".backuper~~"};
+  for (const auto& name : kNames) {
+    WriteFile(source / name, name);
+  }
+  fs::create_directories(source / ".backuper");
+  WriteFile(source / ".backuper" / "file", "data");
+
+  sandbox.Backup(true, "reserved names");
+  auto out = sandbox.Restore("reserved names");
+  for (const auto& name : kNames) {
+    Check(ReadFile(out / name) == name, "reserved names: " + name);
+  }
+  Check(ReadFile(out / ".backuper" / "file") == "data",
+        "reserved names: service dir name");
+
+  // An increment finds the entries in the full backup under their escaped
+  // names
+  WriteFile(source / ".backuper" / "file", "changed");
+  WriteFile(source / ".backuper~", "changed");
+  sandbox.Backup(false, "changed reserved names");
+  out = sandbox.Restore("changed reserved names");
+  Check(ReadFile(out / ".backuper" / "file") == "changed",
+        "changed reserved names: service dir name");
+  Check(ReadFile(out / ".backuper~") == "changed",
+        "changed reserved names: escaped name");
+  Check(ReadFile(out / ".full_backup") == ".full_backup",
+        "changed reserved names: unchanged entry");
+}
+
+} // namespace
+
+int main() {
+  util::format::is_quiet = true;
+
+  TestSymlinks();
+  TestNewlines();
+  TestReservedNames();
+
+  if (failures > 0) {
+    fmt::print(stderr, "{} checks failed\n", failures);
+    return 1;
+  }
+  return 0;
+}
\ No newline at end of file
@@ -0,0 +1,205 @@
+#include "../util/backup/checkpoint.hpp"
+#include "../util/format.hpp"
+
+#include <algorithm>
+#include <csignal>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <fmt/format.h>
+
+#include <boost/filesystem.hpp>
+#include <boost/filesystem/fstream.hpp>
+#include <boost/system/error_code.hpp>
+
+// Checks that the journal orders the paths the way the backups walk them and
+// that a run killed in the middle is resumed from its last flush. Exits with
+// 1 if any check fails
+
+namespace {
+
+namespace fs = boost::filesystem;
+namespace system = boost::system;
+
+using util::backup::PathState;
+
+const std::string kBase{"base"};
+
+int failures = 0;
+
+void Check(bool condition, std::string_view what) {
+  if (!condition) {
+    fmt::print(stderr, "FAILED: {}\n", what);
+    ++failures;
+  }
+}
+
+std::string_view GetStateName(PathState state) {
+  switch (state) {
+    case PathState::kPending:
+      return "pending";
+    case PathState::kCompleted:
+      return "completed";
+    case PathState::kLast:
+      return "last";
+    case PathState::kInterrupted:
+      return "interrupted";
+  }
+  return {};
+}
+
+// A dir of the source tree, with no entries if it is a file
+struct Entry {
+  std::string name;
+  std::vector<Entry> entries;
+};
+
+// Lists the paths in the order of the backups: depth first, with the entries
+// of every dir sorted by name and a dir ahead of its subtree
+void Walk(const std::string& dir_value, std::vector<Entry> entries,
+          std::vector<std::string>& walk) {
+  std::ranges::sort(entries, {}, &Entry::name);
+  for (const auto& entry : entries) {
+    auto value = dir_value + '/' + entry.name;
+    walk.push_back(value);
+    Walk(value, entry.entries, walk);
+  }
+}
+
+// Names that sort apart bytewise and by the walk, where '/' goes first:
+// "a-b" and "a.b" are ahead of "a/x" bytewise, but after the subtree of "a"
+// in the walk. Bytes from 0x80 are above ASCII ones
+std::vector<std::string> GetWalk() {
+  std::vector<std::string> walk;
+  Walk({},
+       {{"b", {}},
+        {"a.b", {{"z", {}}}},
+        {"a", {{"y", {}}, {"x", {{"deep", {}}}}}},
+        {"a-b", {}},
+        {"a\x80", {}},
+        {"\xc3\xa9", {{"a", {}}}},
+        {"a0", {}}},
+       walk);
+  return walk;
+}
+
+bool IsInside(std::string_view path, std::string_view dir) {
+  return path.starts_with(dir) && path.size() > dir.size() &&
+         path[dir.size()] == '/';
+}
+
+PathState GetExpectedState(const std::vector<std::string>& walk, size_t path,
+                           size_t last) {
+  if (path == last) {
+    return PathState::kLast;
+  }
+  if (path > last) {
+    return PathState::kPending;
+  }
+  return IsInside(walk[last], walk[path]) ? PathState::kInterrupted
+                                          : PathState::kCompleted;
+}
+
+// Every path is checked against every last path journaled
+void TestOrdering(const fs::path& dir) {
+  auto walk = GetWalk();
+  system::error_code error;
+  util::backup::Checkpoint checkpoint{dir / "ordering", kBase, error};
+  Check(!error, "ordering: created");
+  Check(checkpoint.IsEmpty(), "ordering: empty");
+  for (const auto& path : walk) {
+    Check(checkpoint.GetState(path) == PathState::kPending,
+          fmt::format("ordering: {} pending before the run", path));
+  }
+
+  for (size_t last = 0; last < walk.size(); ++last) {
+    checkpoint.MarkCompleted(walk[last], error);
+    for (size_t path = 0; path < walk.size(); ++path) {
+      auto expected = GetExpectedState(walk, path, last);
+      auto state = checkpoint.GetState(walk[path]);
+      Check(state == expected,
+            fmt::format("ordering: {} is {} after {}, expected {}", walk[path],
+                        GetStateName(state), walk[last],
+                        GetStateName(expected)));
+    }
+  }
+}
+
+// A child journals a part of the walk, marks some more paths and is killed
+// before they are flushed. The next run must resume right after the flush
+void TestKillAndResume(const fs::path& dir) {
+  auto walk = GetWalk();
+  auto staging = dir / "resume";
+  const size_t kFlushed = 3;
+
+  pid_t pid = ::fork();
+  if (pid == 0) {
+    system::error_code error;
+    util::backup::Checkpoint checkpoint{staging, kBase, error};
+    for (size_t i = 0; i <= kFlushed; ++i) {
+      checkpoint.MarkCompleted(walk[i], error);
+    }
+    checkpoint.Flush(error);
+    for (size_t i = kFlushed + 1; i < walk.size(); ++i) {
+      checkpoint.MarkCompleted(walk[i], error);
+    }
+    std::raise(SIGKILL);
+  }
+
+  int status = 0;
+  ::waitpid(pid, &status, 0);
+  Check(WIFSIGNALED(status) && WTERMSIG(status) == SIGKILL,
+        "resume: child killed");
+
+  system::error_code error;
+  {
+    util::backup::Checkpoint checkpoint{staging, kBase, error};
+    Check(!error, "resume: reopened");
+    for (size_t path = 0; path < walk.size(); ++path) {
+      Check(checkpoint.GetState(walk[path]) ==
+                GetExpectedState(walk, path, kFlushed),
+            fmt::format("resume: {} after the kill", walk[path]));
+    }
+
+    for (size_t i = kFlushed + 1; i < walk.size(); ++i) {
+      checkpoint.MarkCompleted(walk[i], error);
+    }
+    checkpoint.Flush(error);
+    Check(!error, "resume: finished");
+  }
+
+  {
+    util::backup::Checkpoint checkpoint{staging, kBase, error};
+    Check(checkpoint.GetState(walk.back()) == PathState::kLast,
+          "resume: the rest journaled");
+  }
+
+  // The work done against another base is not trusted
+  fs::ofstream{staging / "marker"};
+  util::backup::Checkpoint checkpoint{staging, "other base", error};
+  Check(!error && checkpoint.IsEmpty(), "resume: other base starts over");
+  Check(!fs::exists(staging / "marker"), "resume: other base cleans up");
+}
+
+} // namespace
+
+int main() {
+  util::format::is_quiet = true;
+  auto dir =
+      fs::temp_directory_path() / fs::unique_path("checkpoint_test-%%%%-%%%%");
+  fs::create_directories(dir);
+
+  TestOrdering(dir);
+  TestKillAndResume(dir);
+
+  fs::remove_all(dir);
+  if (failures > 0) {
+    fmt::print(stderr, "{} checks failed\n", failures);
+    return 1;
+  }
+  return 0;
+}
\ No newline at end of file
@@ -0,0 +1,240 @@
+#include "../util/crypto/cipher.hpp"
+#include "../util/filesystem/copy.hpp"
+#include "../util/format.hpp"
+
+#include <cstdint>
+#include <random>
+#include <string>
+#include <string_view>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <fmt/format.h>
+
+#include <boost/filesystem.hpp>
+#include <boost/filesystem/fstream.hpp>
+#include <boost/system/error_code.hpp>
+
+// Encrypts and decrypts files of the shapes the backups meet, and checks that
+// damaged copies are refused. Exits with 1 if any check fails
+
+namespace {
+
+namespace fs = boost::filesystem;
+namespace system = boost::system;
+
+const size_t kChunkSize = 1 << 20;
+const size_t kHeaderSize = 28;
+const size_t kTagSize = 16;
+
+int failures = 0;
+
+void Check(bool condition, std::string_view what) {
+  if (!condition) {
+    fmt::print(stderr, "FAILED: {}\n", what);
+    ++failures;
+  }
+}
+
+util::crypto::Key MakeKey(unsigned char seed) {
+  util::crypto::Key key;
+  for (size_t i = 0; i < key.size(); ++i) {
+    key[i] = static_cast<unsigned char>(seed + i);
+  }
+  return key;
+}
+
+std::string MakeData(size_t size) {
+  std::mt19937 random{static_cast<uint32_t>(size)};
+  std::string data(size, '\0');
+  for (auto& byte : data) {
+    byte = static_cast<char>(random());
+  }
+  return data;
+}
+
+void WriteAt(const fs::path& path, size_t offset, std::string_view data) {
+  int fd = ::open(path.c_str(), O_WRONLY | O_CREAT, 0644);
+  if (fd >= 0) {
+    Check(::pwrite(fd, data.data(), data.size(), offset) ==
+              static_cast<ssize_t>(data.size()),
+          "write " + path.generic_string());
+    ::close(fd);
+  }
+}
+
+std::string ReadAll(const fs::path& path) {
+  fs::ifstream file{path, std::ios::binary};
+  return {std::istreambuf_iterator<char>{file}, {}};
+}
+
+bool IsSparse(const fs::path& path) {
+  struct stat stat;
+  return ::stat(path.c_str(), &stat) == 0 &&
+         stat.st_blocks * 512 < stat.st_size;
+}
+
+// Transforms the whole file into a new one with a cipher
+system::error_code Transform(const fs::path& from, const fs::path& to,
+                             const util::crypto::Key& key,
+                             util::crypto::Direction direction) {
+  util::crypto::Cipher cipher{key, direction};
+  system::error_code error;
+  fs::remove(to);
+  int from_fd = ::open(from.c_str(), O_RDONLY);
+  int to_fd = ::open(to.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644);
+  cipher.Transform(from_fd, to_fd, fs::file_size(from), error);
+  ::close(from_fd);
+  ::close(to_fd);
+  return error;
+}
+
+class Test {
+ public:
+  explicit Test(const fs::path& dir)
+      : plain_{dir / "plain"},
+        encrypted_{dir / "encrypted"},
+        decrypted_{dir / "decrypted"} {
+  }
+
+  void RoundTrip(size_t size) {
+    fs::remove(plain_);
+    WriteAt(plain_, 0, MakeData(size));
+    RoundTripPlain(fmt::format("{} bytes", size));
+  }
+
+  // Chunks in holes and chunks of written zeros are both left as holes
+  void RoundTripSparse() {
+    fs::remove(plain_);
+    WriteAt(plain_, 0, MakeData(100));
+    WriteAt(plain_, kChunkSize, std::string(kChunkSize, '\0'));
+    WriteAt(plain_, 4 * kChunkSize + 5, MakeData(200));
+    RoundTripPlain("sparse file");
+    Check(IsSparse(encrypted_), "sparse file: encrypted copy is sparse");
+    Check(IsSparse(decrypted_), "sparse file: decrypted copy is sparse");
+  }
+
+  // The plaintext is a 3.5 chunk file encrypted by the last round trip
+  void Tamper(size_t offset, std::string_view what) {
+    auto encrypted = ReadAll(encrypted_);
+    auto damaged = encrypted_;
+    damaged += ".damaged";
+    fs::remove(damaged);
+    WriteAt(damaged, 0, encrypted);
+    WriteAt(damaged, offset, std::string(1, encrypted[offset] ^ 1));
+    ExpectRefused(damaged, kKey, what);
+  }
+
+  void Truncate(size_t cut, std::string_view what) {
+    auto encrypted = ReadAll(encrypted_);
+    auto damaged = encrypted_;
+    damaged += ".damaged";
+    fs::remove(damaged);
+    WriteAt(damaged, 0,
+            std::string_view{encrypted}.substr(0, encrypted.size() - cut));
+    ExpectRefused(damaged, kKey, what);
+  }
+
+  void SwapChunks() {
+    auto encrypted = ReadAll(encrypted_);
+    const size_t kSealedSize = kChunkSize + kTagSize;
+    std::string_view first{encrypted.data() + kHeaderSize, kSealedSize};
+    std::string_view second{encrypted.data() + kHeaderSize + kSealedSize,
+                            kSealedSize};
+    auto damaged = encrypted_;
+    damaged += ".damaged";
+    fs::remove(damaged);
+    WriteAt(damaged, 0, encrypted);
+    WriteAt(damaged, kHeaderSize, second);
+    WriteAt(damaged, kHeaderSize + kSealedSize, first);
+    ExpectRefused(damaged, kKey, "swapped chunks");
+  }
+
+  void WrongKey() {
+    ExpectRefused(encrypted_, MakeKey(2), "wrong key");
+  }
+
+  // A copy refused by the cipher leaves no plaintext behind
+  void CopyRefused() {
+    auto damaged = encrypted_;
+    damaged += ".damaged";
+    util::crypto::Cipher cipher{kKey, util::crypto::Direction::kDecrypt};
+    system::error_code error;
+    fs::remove(decrypted_);
+    util::filesystem::CopyFile(damaged, decrypted_, fs::copy_options::none,
+                               &cipher, util::filesystem::Attributes::kSkip,
+                               error);
+    Check(error == system::errc::bad_message, "refused copy: bad message");
+    Check(!fs::exists(decrypted_), "refused copy: no output left");
+  }
+
+  size_t GetEncryptedSize() const {
+    return fs::file_size(encrypted_);
+  }
+
+ private:
+  void RoundTripPlain(const std::string& what) {
+    auto error = Transform(plain_, encrypted_, kKey,
+                           util::crypto::Direction::kEncrypt);
+    Check(!error, what + ": encrypted");
+    Check(fs::file_size(encrypted_) ==
+              util::crypto::GetEncryptedSize(fs::file_size(plain_)),
+          what + ": encrypted size");
+
+    error = Transform(encrypted_, decrypted_, kKey,
+                      util::crypto::Direction::kDecrypt);
+    Check(!error, what + ": decrypted");
+    Check(ReadAll(decrypted_) == ReadAll(plain_), what + ": same contents");
+  }
+
+  void ExpectRefused(const fs::path& damaged, const util::crypto::Key& key,
+                     std::string_view what) {
+    auto error =
+        Transform(damaged, decrypted_, key, util::crypto::Direction::kDecrypt);
+    Check(error == system::errc::bad_message,
+          fmt::format("{}: refused, got {}", what, error.message()));
+  }
+
+  const util::crypto::Key kKey = MakeKey(1);
+  fs::path plain_;
+  fs::path encrypted_;
+  fs::path decrypted_;
+};
+
+} // namespace
+
+int main() {
+  util::format::is_quiet = true;
+  auto dir =
+      fs::temp_directory_path() / fs::unique_path("cipher_test-%%%%-%%%%");
+  fs::create_directories(dir);
+
+  Test test{dir};
+  test.RoundTripSparse();
+  for (size_t size : {size_t{0}, size_t{1}, kChunkSize - 1, kChunkSize,
+                      kChunkSize + 1, 3 * kChunkSize + kChunkSize / 2}) {
+    test.RoundTrip(size);
+  }
+
+  const size_t kSize = test.GetEncryptedSize();
+  test.Tamper(0, "damaged magic");
+  test.Tamper(8, "damaged size");
+  test.Tamper(20, "damaged nonce");
+  test.Tamper(kHeaderSize + 7, "damaged chunk");
+  test.Tamper(kHeaderSize + kChunkSize, "damaged tag");
+  test.Tamper(kSize - kTagSize - 1, "damaged zero map");
+  test.Truncate(1, "cut tail");
+  test.Truncate(kChunkSize, "cut chunk");
+  test.SwapChunks();
+  test.WrongKey();
+  test.CopyRefused();
+
+  fs::remove_all(dir);
+  if (failures > 0) {
+    fmt::print(stderr, "{} checks failed\n", failures);
+    return 1;
+  }
+  return 0;
+}
\ No newline at end of file
@@ -0,0 +1,215 @@
+#include "checkpoint.hpp"
+#include "snapshot.hpp"
+#include "../encoding.hpp"
+#include "../filesystem/sync.hpp"
+#include "../format.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <string_view>
+
+#include <boost/filesystem.hpp>
+#include <boost/filesystem/fstream.hpp>
+#include <boost/system/error_code.hpp>
+
+namespace util::backup {
+
+namespace {
+namespace fs = boost::filesystem;
+namespace system = boost::system;
+
+const fs::path kCheckpointFile{".checkpoint"};
+const fs::path kFullStagingDir{".staging_full"};
+const fs::path kIncrementStagingDir{".staging_increment"};
+const std::string kBasePrefix{"base "};
+
+// The time after which the journal is written to disk. Every write syncs the
+// whole filesystem, so it is bounded by time rather than by the paths copied,
+// which are tiny files as often as not
+const auto kCheckpointInterval = std::chrono::seconds{10};
+
+// Leaves the staging dir with nothing but an empty service dir
+void RecreateDir(const fs::path& dir, system::error_code& error) {
+  fs::remove_all(dir, error);
+  if (error) {
+    util::format::PrintError("Error while deleting stale dir {}\n",
+                             dir.generic_string());
+    return;
+  }
+
+  auto service_dir = GetServiceDir(dir);
+  fs::create_directories(service_dir, error);
+  if (error) {
+    util::format::PrintError("Error while creating dir {}\n",
+                             service_dir.generic_string());
+  }
+}
+
+// Whether the walk reaches lhs before rhs. A dir is followed by its subtree,
+// so the separator goes before any character of a name
+bool IsBefore(std::string_view lhs, std::string_view rhs) {
+  auto [lhs_it, rhs_it] = std::ranges::mismatch(lhs, rhs);
+  if (rhs_it == rhs.end()) {
+    return false;
+  }
+  if (lhs_it == lhs.end() || *lhs_it == '/') {
+    return true;
+  }
+  if (*rhs_it == '/') {
+    return false;
+  }
+  return static_cast<unsigned char>(*lhs_it) <
+         static_cast<unsigned char>(*rhs_it);
+}
+
+} // namespace
+
+fs::path GetStagingDir(const fs::path& where, bool is_full) {
+  return where / (is_full ? kFullStagingDir : kIncrementStagingDir);
+}
+
+void CommitStagingDir(const fs::path& staging, const fs::path& dest,
+                      system::error_code& error) {
+  util::filesystem::SyncFilesystem(staging, error);
+  if (error) {
+    return;
+  }
+
+  fs::rename(staging, dest, error);
+  if (error) {
+    util::format::PrintError("Error while renaming {} to {}\n",
+                             staging.generic_string(), dest.generic_string());
+    return;
+  }
+
+  util::filesystem::Sync(dest.parent_path(), error);
+}
+
+Checkpoint::Checkpoint(const fs::path& staging, const std::string& base,
+                       system::error_code& error)
+    : path_{GetServiceDir(staging) / kCheckpointFile} {
+  // The base and the paths are hex encoded, since a path may hold newlines
+  auto header = kBasePrefix + util::encoding::ToHex(base);
+  fs::ifstream file{path_};
+  std::string line;
+  if (std::getline(file, line) && !file.eof() && line == header) {
+    // The last line is not terminated if the run died in the middle of
+    // a flush. It is not trusted and is cut off, so that the next line
+    // appended does not merge with it
+    uintmax_t size = line.size() + 1;
+    std::string path;
+    while (std::getline(file, line) && !file.eof() &&
+           util::encoding::FromHex(line, path)) {
+      size += line.size() + 1;
+      last_ = std::move(path);
+    }
+    file.close();
+
+    if (size < fs::file_size(path_, error) && !error) {
+      fs::resize_file(path_, size, error);
+    }
+    if (error) {
+      util::format::PrintError("Error while cutting torn line of {}\n",
+                               path_.generic_string());
+    }
+    return;
+  }
+  file.close();
+
+  RecreateDir(staging, error);
+  if (error) {
+    return;
+  }
+
+  pending_header_ = std::move(header) + '\n';
+  Flush(error);
+}
+
+PathState Checkpoint::GetState(const std::string& path) const {
+  if (last_.empty()) {
+    return PathState::kPending;
+  }
+  if (path == last_) {
+    return PathState::kLast;
+  }
+  if (last_.starts_with(path) && last_[path.size()] == '/') {
+    return PathState::kInterrupted;
+  }
+  return IsBefore(path, last_) ? PathState::kCompleted : PathState::kPending;
+}
+
+bool Checkpoint::IsEmpty() const {
+  return last_.empty();
+}
+
+void Checkpoint::MarkCompleted(std::string path, system::error_code& error) {
+  last_ = std::move(path);
+  ++pending_count_;
+  if (std::chrono::steady_clock::now() - last_flush_ >= kCheckpointInterval) {
+    Flush(error);
+  }
+}
+
+void Checkpoint::Flush(system::error_code& error) {
+  // Only the last path of the batch is needed to resume the walk
+  std::string lines = pending_header_;
+  if (pending_count_ > 0) {
+    lines += util::encoding::ToHex(last_);
+    lines += '\n';
+  }
+  if (lines.empty()) {
+    return;
+  }
+
+  if (on_flush_) {
+    on_flush_(error);
+    if (error) {
+      return;
+    }
+  }
+
+  // The copies and the metadata of the batch must not be journaled before
+  // they are on disk
+  util::filesystem::SyncFilesystem(path_.parent_path(), error);
+  if (error) {
+    return;
+  }
+
+  fs::ofstream file{path_, std::ios::app};
+  file << lines;
+  file.close();
+  if (!file) {
+    error = system::errc::make_error_code(system::errc::io_error);
+    util::format::PrintError("Error while writing checkpoint {}\n",
+                             path_.generic_string());
+    return;
+  }
+
+  util::filesystem::Sync(path_, error);
+  if (error) {
+    return;
+  }
+
+  pending_header_.clear();
+  pending_count_ = 0;
+  last_flush_ = std::chrono::steady_clock::now();
+}
+
+void Checkpoint::SetOnFlush(
+    std::function<void(system::error_code&)> on_flush) {
+  on_flush_ = std::move(on_flush);
+}
+
+void Checkpoint::Remove(const fs::path& snapshot, system::error_code& error) {
+  pending_header_.clear();
+  pending_count_ = 0;
+  auto path = GetServiceDir(snapshot) / kCheckpointFile;
+  fs::remove(path, error);
+  if (error) {
+    util::format::PrintError("Error while deleting {}\n",
+                             path.generic_string());
+  }
+}
+
+} // namespace util::backup
\ No newline at end of file
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <chrono>
+#include <functional>
+#include <string>
+
+#include <boost/filesystem.hpp>
+#include <boost/system/error_code.hpp>
+
+namespace util::backup {
+
+namespace {
+namespace fs = boost::filesystem;
+namespace system = boost::system;
+} // namespace
+
+// Every backup is written into a staging dir first and renamed into its
+// timestamped dir only when it is complete. The staging dir of an
+// interrupted run is picked up by the next run of the same kind
+fs::path GetStagingDir(const fs::path& where, bool is_full);
+
+// Syncs the staging dir to disk and renames it to dest
+void CommitStagingDir(const fs::path& staging, const fs::path& dest,
+                      system::error_code& error);
+
+// Where a path of the backed up dir stands against the journal
+enum class PathState {
+  // Not reached yet by the interrupted run
+  kPending,
+  // Handled with all its subtree
+  kCompleted,
+  // The last path journaled. Its subtree may be only partly handled
+  kLast,
+  // A dir the last path journaled is in
+  kInterrupted,
+};
+
+// Journal of the progress made in a staging dir. The backed up dir is walked
+// depth first with the entries of every dir sorted by name, so the progress
+// is the last path (relative to the backed up dir) handled, and the journal
+// takes the same memory whatever the size of the tree. The path is appended
+// to the journal file every few seconds, so that a rerun can skip the work
+// done before a crash
+class Checkpoint {
+ public:
+  // Loads the journal of the staging dir if it was written against the same
+  // base, i.e. the same source, full backup and key, otherwise cleans the
+  // staging dir up
+  Checkpoint(const fs::path& staging, const std::string& base,
+             system::error_code& error);
+
+  PathState GetState(const std::string& path) const;
+
+  bool IsEmpty() const;
+
+  // The paths must be marked in the order of the walk
+  void MarkCompleted(std::string path, system::error_code& error);
+
+  void Flush(system::error_code& error);
+
+  // The callback is run before the journal is written, so that whatever the
+  // journaled paths depend on is written first. The filesystem is synced
+  // before the journal is appended, so a journaled path survives a power loss
+  void SetOnFlush(std::function<void(system::error_code&)> on_flush);
+
+  // Drops the journal once the staging dir is committed to the snapshot. Until
+  // then the journal is kept, so a run dying at commit can still be resumed
+  void Remove(const fs::path& snapshot, system::error_code& error);
+
+ private:
+  fs::path path_;
+  std::string last_;
+  std::string pending_header_;
+  size_t pending_count_ = 0;
+  std::chrono::steady_clock::time_point last_flush_ =
+      std::chrono::steady_clock::now();
+  std::function<void(system::error_code&)> on_flush_;
+};
+
+} // namespace util::backup
\ No newline at end of file
@@ -1,4 +1,6 @@
 #include "full_backup.hpp"
+#include "snapshot.hpp"
+#include "../filesystem/sync.hpp"
 #include "../format.hpp"
 
 #include <boost/filesystem.hpp>
@@ -14,6 +16,8 @@ namespace system = boost::system;
 
 const fs::path kLatestFullBackupFile{".latest_full_backup"};
 const fs::path kFullBackup{".full_backup"};
+const fs::path kEncrypted{".encrypted"};
+const fs::path kTmpSuffix{".tmp"};
 
 bool CheckFileExists(const fs::path& path, system::error_code& error) {
   bool exists = fs::exists(path, error);
@@ -43,27 +47,78 @@ std::pair<bool, fs::path> GetLatestFullBackup(const fs::path& where, system::err
   return {true,std::move(backup_dir)};
 }
 
-void UpdateLatestFullBackup(const fs::path& where, const std::string_view new_backup_folder) {
-  fs::ofstream file{where / kLatestFullBackupFile};
-  file << new_backup_folder;
+// Writes the pointer to a temporary file and renames it over the old one, so
+// that the pointer is never observed half-written, even after a power loss
+void UpdateLatestFullBackup(const fs::path& where, const std::string_view new_backup_folder, system::error_code& error) {
+  fs::path path = where / kLatestFullBackupFile;
+  fs::path tmp_path = path;
+  tmp_path += kTmpSuffix;
+
+  {
+    fs::ofstream file{tmp_path};
+    file << new_backup_folder;
+    file.close();
+    if (!file) {
+      error = system::errc::make_error_code(system::errc::io_error);
+      util::format::PrintError("Error while writing {}\n", tmp_path.generic_string());
+      return;
+    }
+  }
+
+  util::filesystem::Sync(tmp_path, error);
+  if (error) {
+    return;
+  }
+
+  fs::rename(tmp_path, path, error);
+  if (error) {
+    util::format::PrintError("Error while renaming {} to {}\n", tmp_path.generic_string(), path.generic_string());
+    return;
+  }
+
+  util::filesystem::Sync(where, error);
 }
 
+// Snapshots made before the service dir kept the mark at their root
 bool CheckIsFullBackup(const fs::path& where, system::error_code& error) {
-  return CheckFileExists(where / kFullBackup, error);
+  auto service_dir = GetServiceDir(where);
+  bool has_service_dir = CheckFileExists(service_dir, error);
+  if (error) {
+    return false;
+  }
+  return CheckFileExists((has_service_dir ? service_dir : where) / kFullBackup, error);
 }
 
 // Creates an empty file in a full backup folder. Since then it means that
 // the folder is the folder of a full backup
 void MarkAsFullBackup(const fs::path& where) {
-  fs::ofstream new_file{where / kFullBackup};
+  fs::ofstream new_file{GetServiceDir(where) / kFullBackup};
 }
 
 void UnmarkAsFullBackup(const fs::path& where, system::error_code& error) {
-  auto path = where / kFullBackup;
+  auto path = GetServiceDir(where) / kFullBackup;
   fs::remove(path, error);
   if (error) {
     util::format::PrintError("Error while deleting {}", path.generic_string());
   }
 }
 
+void MarkAsEncrypted(const fs::path& where, const std::string& key_id, system::error_code& error) {
+  auto path = GetServiceDir(where) / kEncrypted;
+  fs::ofstream file{path};
+  file << key_id;
+  file.flush();
+  if (!file) {
+    error = system::errc::make_error_code(system::errc::io_error);
+    util::format::PrintError("Error while writing {}\n", path.generic_string());
+  }
+}
+
+std::string ReadKeyId(const fs::path& where) {
+  fs::ifstream file{GetServiceDir(where) / kEncrypted};
+  std::string key_id;
+  file >> key_id;
+  return key_id;
+}
+
 } // namespace util::backup
\ No newline at end of file
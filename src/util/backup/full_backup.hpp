@@ -12,7 +12,7 @@ namespace system = boost::system;
 
 std::pair<bool, fs::path> GetLatestFullBackup(const fs::path& where, system::error_code& error);
 
-void UpdateLatestFullBackup(const fs::path& where, const std::string_view new_backup_folder);
+void UpdateLatestFullBackup(const fs::path& where, const std::string_view new_backup_folder, system::error_code& error);
 
 bool CheckIsFullBackup(const fs::path& where, system::error_code& error);
 
@@ -20,4 +20,10 @@ void MarkAsFullBackup(const fs::path& where);
 
 void UnmarkAsFullBackup(const fs::path& where, system::error_code& error);
 
+// Records the id of the key the snapshot is encrypted with
+void MarkAsEncrypted(const fs::path& where, const std::string& key_id, system::error_code& error);
+
+// The id of the key the snapshot is encrypted with, empty if it is not
+std::string ReadKeyId(const fs::path& where);
+
 } // namespace util::backup
\ No newline at end of file
@@ -0,0 +1,58 @@
+#include "snapshot.hpp"
+
+#include <string_view>
+
+#include <boost/filesystem.hpp>
+
+namespace util::backup {
+
+namespace {
+namespace fs = boost::filesystem;
+
+const std::string kServiceDir{".backuper"};
+
+// Whether the name is the service dir name followed by at least count '~'s
+bool IsEscaped(std::string_view name, size_t count) {
+  return name.starts_with(kServiceDir) &&
+         name.size() >= kServiceDir.size() + count &&
+         name.find_first_not_of('~', kServiceDir.size()) == name.npos;
+}
+
+} // namespace
+
+fs::path GetServiceDir(const fs::path& snapshot) {
+  return snapshot / kServiceDir;
+}
+
+bool IsServiceDir(const fs::path& path) {
+  return path.filename() == kServiceDir;
+}
+
+std::string GetSnapshotValue(const std::string& value) {
+  if (value.empty()) {
+    return value;
+  }
+
+  auto end = value.find('/', 1);
+  if (end == value.npos) {
+    end = value.size();
+  }
+
+  auto name = std::string_view{value}.substr(1, end - 1);
+  if (!IsEscaped(name, 0)) {
+    return value;
+  }
+  auto escaped = value;
+  escaped.insert(end, 1, '~');
+  return escaped;
+}
+
+fs::path GetSourceName(const fs::path& path) {
+  auto name = path.filename().string();
+  if (IsEscaped(name, 1)) {
+    name.pop_back();
+  }
+  return name;
+}
+
+} // namespace util::backup
\ No newline at end of file
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <string>
+
+#include <boost/filesystem.hpp>
+
+namespace util::backup {
+
+namespace {
+namespace fs = boost::filesystem;
+} // namespace
+
+// The files a snapshot keeps about itself live in a single dir at its root.
+// A backed up root entry named like the dir, optionally followed by '~'s,
+// is kept with one more '~' appended, so the data never meets them
+fs::path GetServiceDir(const fs::path& snapshot);
+
+bool IsServiceDir(const fs::path& path);
+
+// The path a source path is kept under in a snapshot. Both are relative to
+// their roots and start with '/'
+std::string GetSnapshotValue(const std::string& value);
+
+// The name a root entry of a snapshot is restored under
+fs::path GetSourceName(const fs::path& path);
+
+} // namespace util::backup
\ No newline at end of file
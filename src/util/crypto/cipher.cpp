@@ -0,0 +1,457 @@
+#include "cipher.hpp"
+#include "../format.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+#include <fmt/format.h>
+
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+
+#include <boost/filesystem.hpp>
+#include <boost/filesystem/fstream.hpp>
+#include <boost/system/error_code.hpp>
+
+namespace util::crypto {
+
+namespace {
+namespace fs = boost::filesystem;
+namespace system = boost::system;
+
+// The format of an encrypted file: the header of the magic, the plaintext
+// size and the nonce of the file, then every chunk of the plaintext followed
+// by its tag, then the sealed map of the chunks of zeros. Such chunks are
+// left as holes, so sparse files stay sparse. The map is what tells them
+// from a chunk zeroed out by someone else
+const std::array<unsigned char, 8> kMagic = {'B', 'K', 'P', 'E',
+                                             'N', 'C', '0', '1'};
+const size_t kSizeOffset = kMagic.size();
+const size_t kNonceOffset = kSizeOffset + sizeof(uint64_t);
+const size_t kNonceSize = 12;
+const size_t kHeaderSize = kNonceOffset + kNonceSize;
+const size_t kTagSize = 16;
+// Big enough for the tags and the per chunk calls to cost nothing, small
+// enough for a chunk per thread to be kept in memory
+const uint64_t kChunkSize = 1 << 20;
+const std::string kKeyIdPrefix = "backuper key id ";
+const size_t kKeyIdSize = 8;
+
+using Header = std::array<unsigned char, kHeaderSize>;
+using Nonce = std::array<unsigned char, kNonceSize>;
+
+system::error_code LastError() {
+  return {errno, system::system_category()};
+}
+
+system::error_code BadMessage() {
+  return system::errc::make_error_code(system::errc::bad_message);
+}
+
+// Closes the OpenSSL context whatever way the chunk ends
+class CipherContext {
+ public:
+  CipherContext() : ctx_{EVP_CIPHER_CTX_new()} {
+  }
+
+  CipherContext(const CipherContext&) = delete;
+  CipherContext& operator=(const CipherContext&) = delete;
+
+  ~CipherContext() {
+    EVP_CIPHER_CTX_free(ctx_);
+  }
+
+  EVP_CIPHER_CTX* Get() const {
+    return ctx_;
+  }
+
+ private:
+  EVP_CIPHER_CTX* ctx_;
+};
+
+using ChunkHandler = std::function<void(EVP_CIPHER_CTX* ctx, uint64_t chunk,
+                                        std::vector<unsigned char>& buffer,
+                                        system::error_code& error)>;
+
+uint64_t GetChunkCount(uint64_t size) {
+  return (size + kChunkSize - 1) / kChunkSize;
+}
+
+uint64_t GetChunkSize(uint64_t size, uint64_t chunk) {
+  return std::min(kChunkSize, size - chunk * kChunkSize);
+}
+
+off_t GetEncryptedChunkOffset(uint64_t chunk) {
+  return kHeaderSize + chunk * (kChunkSize + kTagSize);
+}
+
+off_t GetZeroMapOffset(uint64_t size) {
+  return kHeaderSize + size + GetChunkCount(size) * kTagSize;
+}
+
+void ReadExactly(int fd, unsigned char* data, size_t len, off_t offset,
+                 system::error_code& error) {
+  while (len > 0) {
+    ssize_t read = ::pread(fd, data, len, offset);
+    if (read <= 0) {
+      error = read < 0 ? LastError()
+                       : system::errc::make_error_code(system::errc::io_error);
+      return;
+    }
+    data += read;
+    offset += read;
+    len -= read;
+  }
+}
+
+void WriteExactly(int fd, const unsigned char* data, size_t len, off_t offset,
+                  system::error_code& error) {
+  while (len > 0) {
+    ssize_t written = ::pwrite(fd, data, len, offset);
+    if (written < 0) {
+      error = LastError();
+      return;
+    }
+    data += written;
+    offset += written;
+    len -= written;
+  }
+}
+
+// The chunk number is mixed into the nonce of the file, so a chunk only
+// opens at its own place
+Nonce GetChunkNonce(const Header& header, uint64_t chunk) {
+  Nonce nonce;
+  std::copy_n(header.begin() + kNonceOffset, kNonceSize, nonce.begin());
+  for (size_t i = 0; i < sizeof(chunk); ++i) {
+    nonce[kNonceSize - 1 - i] ^= static_cast<unsigned char>(chunk >> (8 * i));
+  }
+  return nonce;
+}
+
+// Seals the chunk in place and puts the tag right after it. The zero map is
+// sealed as one more chunk after the last one
+void SealChunk(EVP_CIPHER_CTX* ctx, const Header& header, uint64_t chunk,
+               unsigned char* data, size_t len, system::error_code& error) {
+  auto nonce = GetChunkNonce(header, chunk);
+  int out_len = 0;
+  if (EVP_EncryptInit_ex(ctx, nullptr, nullptr, nullptr, nonce.data()) != 1 ||
+      EVP_EncryptUpdate(ctx, nullptr, &out_len, header.data(),
+                        header.size()) != 1 ||
+      EVP_EncryptUpdate(ctx, data, &out_len, data, len) != 1 ||
+      EVP_EncryptFinal_ex(ctx, data + len, &out_len) != 1 ||
+      EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, kTagSize, data + len) !=
+          1) {
+    error = system::errc::make_error_code(system::errc::io_error);
+  }
+}
+
+// Opens the chunk followed by its tag in place
+void OpenChunk(EVP_CIPHER_CTX* ctx, const Header& header, uint64_t chunk,
+               unsigned char* data, size_t len, system::error_code& error) {
+  auto nonce = GetChunkNonce(header, chunk);
+  int out_len = 0;
+  if (EVP_DecryptInit_ex(ctx, nullptr, nullptr, nullptr, nonce.data()) != 1 ||
+      EVP_DecryptUpdate(ctx, nullptr, &out_len, header.data(),
+                        header.size()) != 1 ||
+      EVP_DecryptUpdate(ctx, data, &out_len, data, len) != 1 ||
+      EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, kTagSize, data + len) !=
+          1 ||
+      EVP_DecryptFinal_ex(ctx, data + len, &out_len) != 1) {
+    error = BadMessage();
+  }
+}
+
+void InitContext(const CipherContext& ctx, const Key& key,
+                 Direction direction, system::error_code& error) {
+  const auto kInit = direction == Direction::kEncrypt ? EVP_EncryptInit_ex
+                                                      : EVP_DecryptInit_ex;
+  if (ctx.Get() == nullptr || kInit(ctx.Get(), EVP_aes_256_gcm(), nullptr,
+                                    key.data(), nullptr) != 1) {
+    error = system::errc::make_error_code(system::errc::io_error);
+  }
+}
+
+// Helper threads are taken from one budget shared by all the files being
+// transformed at once, e.g. by the jobs of a scheduler, so that together they
+// run about as many threads as there are cores. The calling threads do their
+// share of the work besides the budget, so a file is never left waiting
+class HelperLease {
+ public:
+  explicit HelperLease(uint64_t wanted) {
+    auto& free_helpers = GetFreeHelpers();
+    uint64_t free = free_helpers.load();
+    do {
+      count_ = std::min(wanted, free);
+    } while (count_ > 0 &&
+             !free_helpers.compare_exchange_weak(free, free - count_));
+  }
+
+  HelperLease(const HelperLease&) = delete;
+  HelperLease& operator=(const HelperLease&) = delete;
+
+  ~HelperLease() {
+    GetFreeHelpers() += count_;
+  }
+
+  uint64_t GetCount() const {
+    return count_;
+  }
+
+ private:
+  static std::atomic<uint64_t>& GetFreeHelpers() {
+    static std::atomic<uint64_t> free_helpers =
+        std::max(std::thread::hardware_concurrency(), 1u) - 1;
+    return free_helpers;
+  }
+
+  uint64_t count_ = 0;
+};
+
+// Hands the chunks out to the calling thread and as many helpers as the
+// budget spares. Every thread has its own OpenSSL context and chunk buffer.
+// The first error stops all of them
+void ForEachChunk(const Key& key, Direction direction, uint64_t chunks,
+                  const ChunkHandler& handle_chunk, system::error_code& error) {
+  std::atomic<uint64_t> next_chunk = 0;
+  std::atomic<bool> is_failed = false;
+  std::mutex error_mutex;
+
+  auto run = [&] {
+    system::error_code chunk_error;
+    CipherContext ctx;
+    InitContext(ctx, key, direction, chunk_error);
+
+    std::vector<unsigned char> buffer(kChunkSize + kTagSize);
+    while (!chunk_error && !is_failed) {
+      uint64_t chunk = next_chunk++;
+      if (chunk >= chunks) {
+        return;
+      }
+      handle_chunk(ctx.Get(), chunk, buffer, chunk_error);
+    }
+
+    if (chunk_error) {
+      std::lock_guard lock{error_mutex};
+      if (!is_failed.exchange(true)) {
+        error = chunk_error;
+      }
+    }
+  };
+
+  // The lease outlives the helpers, so it is returned once they are joined
+  HelperLease lease{chunks > 1 ? chunks - 1 : 0};
+  std::vector<std::jthread> helpers;
+  for (uint64_t i = 0; i < lease.GetCount(); ++i) {
+    helpers.emplace_back(run);
+  }
+  run();
+}
+
+// A range in a hole need not even be read
+bool IsHole(int fd, off_t offset, size_t len) {
+  off_t data = ::lseek(fd, offset, SEEK_DATA);
+  return data < 0 ? errno == ENXIO
+                  : data >= offset + static_cast<off_t>(len);
+}
+
+bool IsZero(const unsigned char* data, size_t len) {
+  return len == 0 ||
+         (data[0] == 0 && std::memcmp(data, data + 1, len - 1) == 0);
+}
+
+} // namespace
+
+Key ReadKey(const fs::path& path, system::error_code& error) {
+  Key key{};
+  fs::ifstream file{path, std::ios::binary};
+  if (!file.is_open()) {
+    error = system::errc::make_error_code(
+        system::errc::no_such_file_or_directory);
+    util::format::PrintError("Error while opening key file {}\n",
+                             path.generic_string());
+    return key;
+  }
+
+  file.read(reinterpret_cast<char*>(key.data()), key.size());
+  if (!file || file.peek() != fs::ifstream::traits_type::eof()) {
+    error = system::errc::make_error_code(system::errc::invalid_argument);
+    util::format::PrintError("Key file {} must hold exactly {} bytes\n",
+                             path.generic_string(), key.size());
+  }
+  return key;
+}
+
+std::string GetKeyId(const Key& key) {
+  std::string data = kKeyIdPrefix;
+  data.append(key.begin(), key.end());
+  std::array<unsigned char, EVP_MAX_MD_SIZE> digest;
+  EVP_Digest(data.data(), data.size(), digest.data(), nullptr, EVP_sha256(),
+             nullptr);
+
+  std::string id;
+  for (size_t i = 0; i < kKeyIdSize; ++i) {
+    id += fmt::format("{:02x}", digest[i]);
+  }
+  return id;
+}
+
+Cipher::Cipher(const Key& key, Direction direction)
+    : key_{key}, direction_{direction} {
+}
+
+void Cipher::Transform(int from_fd, int to_fd, off_t size,
+                       system::error_code& error) const {
+  if (direction_ == Direction::kEncrypt) {
+    Encrypt(from_fd, to_fd, size, error);
+  } else {
+    Decrypt(from_fd, to_fd, size, error);
+  }
+}
+
+void Cipher::Encrypt(int from_fd, int to_fd, off_t size,
+                     system::error_code& error) const {
+  Header header;
+  std::ranges::copy(kMagic, header.begin());
+  for (size_t i = 0; i < sizeof(uint64_t); ++i) {
+    header[kSizeOffset + i] = static_cast<unsigned char>(
+        static_cast<uint64_t>(size) >> (8 * i));
+  }
+  if (RAND_bytes(header.data() + kNonceOffset, kNonceSize) != 1) {
+    error = system::errc::make_error_code(system::errc::io_error);
+    return;
+  }
+
+  if (::ftruncate(to_fd, GetEncryptedSize(size)) < 0) {
+    error = LastError();
+    return;
+  }
+  WriteExactly(to_fd, header.data(), header.size(), 0, error);
+  if (error) {
+    return;
+  }
+
+  // Every chunk has its own flag, so the threads never write the same byte
+  const uint64_t kChunks = GetChunkCount(size);
+  std::vector<unsigned char> zero_map(kChunks + kTagSize);
+  ForEachChunk(key_, direction_, kChunks,
+               [&](EVP_CIPHER_CTX* ctx, uint64_t chunk,
+                   std::vector<unsigned char>& buffer,
+                   system::error_code& chunk_error) {
+                 size_t len = GetChunkSize(size, chunk);
+                 off_t offset = chunk * kChunkSize;
+                 if (IsHole(from_fd, offset, len)) {
+                   zero_map[chunk] = 1;
+                   return;
+                 }
+
+                 ReadExactly(from_fd, buffer.data(), len, offset, chunk_error);
+                 if (!chunk_error && IsZero(buffer.data(), len)) {
+                   zero_map[chunk] = 1;
+                   return;
+                 }
+                 if (!chunk_error) {
+                   SealChunk(ctx, header, chunk, buffer.data(), len,
+                             chunk_error);
+                 }
+                 if (!chunk_error) {
+                   WriteExactly(to_fd, buffer.data(), len + kTagSize,
+                                GetEncryptedChunkOffset(chunk), chunk_error);
+                 }
+               },
+               error);
+  if (error) {
+    return;
+  }
+
+  CipherContext ctx;
+  InitContext(ctx, key_, direction_, error);
+  if (!error) {
+    SealChunk(ctx.Get(), header, kChunks, zero_map.data(), kChunks, error);
+  }
+  if (!error) {
+    WriteExactly(to_fd, zero_map.data(), zero_map.size(),
+                 GetZeroMapOffset(size), error);
+  }
+}
+
+void Cipher::Decrypt(int from_fd, int to_fd, off_t size,
+                     system::error_code& error) const {
+  Header header;
+  if (static_cast<size_t>(size) < kHeaderSize) {
+    error = BadMessage();
+    return;
+  }
+  ReadExactly(from_fd, header.data(), header.size(), 0, error);
+  if (error) {
+    return;
+  }
+
+  uint64_t plain_size = 0;
+  for (size_t i = 0; i < sizeof(uint64_t); ++i) {
+    plain_size |= static_cast<uint64_t>(header[kSizeOffset + i]) << (8 * i);
+  }
+  if (!std::equal(kMagic.begin(), kMagic.end(), header.begin()) ||
+      GetEncryptedSize(plain_size) != static_cast<uintmax_t>(size)) {
+    error = BadMessage();
+    return;
+  }
+
+  const uint64_t kChunks = GetChunkCount(plain_size);
+  std::vector<unsigned char> zero_map(kChunks + kTagSize);
+  ReadExactly(from_fd, zero_map.data(), zero_map.size(),
+              GetZeroMapOffset(plain_size), error);
+  if (error) {
+    return;
+  }
+  CipherContext ctx;
+  InitContext(ctx, key_, direction_, error);
+  if (!error) {
+    OpenChunk(ctx.Get(), header, kChunks, zero_map.data(), kChunks, error);
+  }
+  if (error) {
+    return;
+  }
+
+  // The chunks of zeros are left as holes of the sized file
+  if (::ftruncate(to_fd, plain_size) < 0) {
+    error = LastError();
+    return;
+  }
+
+  ForEachChunk(key_, direction_, kChunks,
+               [&](EVP_CIPHER_CTX* ctx, uint64_t chunk,
+                   std::vector<unsigned char>& buffer,
+                   system::error_code& chunk_error) {
+                 if (zero_map[chunk] != 0) {
+                   return;
+                 }
+
+                 size_t len = GetChunkSize(plain_size, chunk);
+                 ReadExactly(from_fd, buffer.data(), len + kTagSize,
+                             GetEncryptedChunkOffset(chunk), chunk_error);
+                 if (!chunk_error) {
+                   OpenChunk(ctx, header, chunk, buffer.data(), len,
+                             chunk_error);
+                 }
+                 if (!chunk_error) {
+                   WriteExactly(to_fd, buffer.data(), len, chunk * kChunkSize,
+                                chunk_error);
+                 }
+               },
+               error);
+}
+
+uintmax_t GetEncryptedSize(uintmax_t size) {
+  return GetZeroMapOffset(size) + GetChunkCount(size) + kTagSize;
+}
+
+} // namespace util::crypto
\ No newline at end of file
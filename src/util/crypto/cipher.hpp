@@ -0,0 +1,62 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <string>
+
+#include <sys/types.h>
+
+#include <boost/filesystem.hpp>
+#include <boost/system/error_code.hpp>
+
+namespace util::crypto {
+
+namespace {
+namespace fs = boost::filesystem;
+namespace system = boost::system;
+} // namespace
+
+// An AES-256 key
+using Key = std::array<unsigned char, 32>;
+
+// The key file holds the raw bytes of the key, e.g. made by
+// head -c 32 /dev/urandom
+Key ReadKey(const fs::path& path, system::error_code& error);
+
+// Tells the backups made with the key from the others without revealing it
+std::string GetKeyId(const Key& key);
+
+enum class Direction {
+  kEncrypt,
+  kDecrypt,
+};
+
+// Encrypts or decrypts file contents with AES-256-GCM. A file is split into
+// chunks sealed on their own, so the chunks of a big file are handled by
+// several threads at once, and chunks of zeros are left as holes. A chunk is
+// bound to its place in its file, and the plaintext size is authenticated,
+// so swapped, moved or cut chunks fail to decrypt
+class Cipher {
+ public:
+  Cipher(const Key& key, Direction direction);
+
+  // Writes the transformed contents of the size bytes of from_fd to the
+  // empty to_fd
+  void Transform(int from_fd, int to_fd, off_t size,
+                 system::error_code& error) const;
+
+ private:
+  void Encrypt(int from_fd, int to_fd, off_t size,
+               system::error_code& error) const;
+
+  void Decrypt(int from_fd, int to_fd, off_t size,
+               system::error_code& error) const;
+
+  Key key_;
+  Direction direction_;
+};
+
+// The size of the encrypted copy of a file of the given size
+uintmax_t GetEncryptedSize(uintmax_t size);
+
+} // namespace util::crypto
\ No newline at end of file
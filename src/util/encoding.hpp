@@ -0,0 +1,50 @@
+#pragma once
+
+#include <iterator>
+#include <string>
+#include <string_view>
+
+#include <fmt/format.h>
+
+namespace util::encoding {
+
+// Paths, xattr names and values are arbitrary bytes, newlines included, so
+// they are hex encoded in the line based files
+inline std::string ToHex(std::string_view bytes) {
+  std::string hex;
+  hex.reserve(bytes.size() * 2);
+  for (unsigned char byte : bytes) {
+    fmt::format_to(std::back_inserter(hex), "{:02x}", byte);
+  }
+  return hex;
+}
+
+// Fails on an odd length or a character that is not a hex digit
+inline bool FromHex(std::string_view hex, std::string& bytes) {
+  auto digit = [](char c) {
+    if (c >= '0' && c <= '9') {
+      return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+      return c - 'a' + 10;
+    }
+    return -1;
+  };
+
+  if (hex.size() % 2 != 0) {
+    return false;
+  }
+  bytes.clear();
+  bytes.reserve(hex.size() / 2);
+  for (size_t i = 0; i < hex.size(); i += 2) {
+    int high = digit(hex[i]);
+    int low = digit(hex[i + 1]);
+    if (high < 0 || low < 0) {
+      return false;
+    }
+    bytes.push_back(static_cast<char>(high << 4 | low));
+  }
+  return true;
+}
+
+} // namespace util::encoding
\ No newline at end of file
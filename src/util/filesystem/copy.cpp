@@ -1,6 +1,14 @@
 #include "copy.hpp"
 #include "../format.hpp"
 
+#include <algorithm>
+#include <cerrno>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include <boost/filesystem.hpp>
 
 namespace util::filesystem {
@@ -10,10 +18,301 @@ namespace {
 namespace fs = boost::filesystem;
 namespace system = boost::system;
 
+// The buffer for filesystems copy_file_range does not work on
+const size_t kBufferSize = 1 << 20;
+
+system::error_code LastError() {
+  return {errno, system::system_category()};
+}
+
+// Closes the descriptor when the copy is done, whatever way it ends
+class FileDescriptor {
+ public:
+  explicit FileDescriptor(int fd) : fd_{fd} {
+  }
+
+  FileDescriptor(const FileDescriptor&) = delete;
+  FileDescriptor& operator=(const FileDescriptor&) = delete;
+
+  ~FileDescriptor() {
+    if (fd_ >= 0) {
+      ::close(fd_);
+    }
+  }
+
+  int Get() const {
+    return fd_;
+  }
+
+ private:
+  int fd_;
+};
+
+void CopyRangeBuffered(int from_fd, int to_fd, off_t offset, off_t len,
+                       system::error_code& error) {
+  std::vector<char> buffer(std::min<size_t>(len, kBufferSize));
+  while (len > 0) {
+    ssize_t read = ::pread(from_fd, buffer.data(),
+                           std::min<size_t>(len, buffer.size()), offset);
+    if (read <= 0) {
+      error = read < 0 ? LastError()
+                       : system::errc::make_error_code(system::errc::io_error);
+      return;
+    }
+
+    for (ssize_t written = 0; written < read;) {
+      ssize_t chunk = ::pwrite(to_fd, buffer.data() + written, read - written,
+                               offset + written);
+      if (chunk < 0) {
+        error = LastError();
+        return;
+      }
+      written += chunk;
+    }
+
+    offset += read;
+    len -= read;
+  }
+}
+
+// Lets the kernel move the data (or share the extents on CoW filesystems)
+// and falls back to the user space copy where it is not supported
+void CopyRange(int from_fd, int to_fd, off_t offset, off_t len,
+               system::error_code& error) {
+  off_t from_offset = offset;
+  off_t to_offset = offset;
+  while (len > 0) {
+    ssize_t copied =
+        ::copy_file_range(from_fd, &from_offset, to_fd, &to_offset, len, 0);
+    if (copied < 0 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL ||
+                       errno == EOPNOTSUPP)) {
+      CopyRangeBuffered(from_fd, to_fd, from_offset, len, error);
+      return;
+    }
+    if (copied <= 0) {
+      error = copied < 0 ? LastError()
+                         : system::errc::make_error_code(system::errc::io_error);
+      return;
+    }
+    len -= copied;
+  }
+}
+
+// Copies only the data extents of the file. The holes are left as holes by
+// sizing the destination up front, and every extent is preallocated before
+// it is written to keep it contiguous
+void CopySparse(int from_fd, int to_fd, off_t size, system::error_code& error) {
+  if (::ftruncate(to_fd, size) < 0) {
+    error = LastError();
+    return;
+  }
+
+  for (off_t offset = 0; offset < size;) {
+    off_t data = ::lseek(from_fd, offset, SEEK_DATA);
+    if (data < 0 && errno == ENXIO) {
+      // The rest of the file is a hole
+      return;
+    }
+
+    off_t hole = size;
+    if (data < 0) {
+      if (errno != EINVAL) {
+        error = LastError();
+        return;
+      }
+      // The filesystem knows nothing about holes
+      data = offset;
+    } else {
+      hole = ::lseek(from_fd, data, SEEK_HOLE);
+      if (hole < 0) {
+        hole = size;
+      }
+      hole = std::min(hole, size);
+    }
+
+    // Preallocation is an optimization only, so its failure is ignored
+    ::fallocate(to_fd, FALLOC_FL_KEEP_SIZE, data, hole - data);
+    CopyRange(from_fd, to_fd, data, hole - data, error);
+    if (error) {
+      return;
+    }
+
+    offset = hole;
+  }
+}
+
+bool HasOption(fs::copy_options options, fs::copy_options option) {
+  return (options & option) != fs::copy_options::none;
+}
+
+bool IsNewer(const struct stat& lhs, const struct stat& rhs) {
+  return lhs.st_mtim.tv_sec > rhs.st_mtim.tv_sec ||
+         (lhs.st_mtim.tv_sec == rhs.st_mtim.tv_sec &&
+          lhs.st_mtim.tv_nsec > rhs.st_mtim.tv_nsec);
+}
+
+// A symlink is copied as a symlink, whatever it points to, so a link to a
+// dir neither loses the dir contents nor makes the tree loop
+void CopySymlink(const fs::path& from, const fs::path& to,
+                 fs::copy_options options, system::error_code& error) {
+  if (fs::symlink_status(to, error).type() != fs::file_type::file_not_found) {
+    if (error) {
+      util::format::PrintError("Error while getting info on {}\n",
+                               to.generic_string());
+      return;
+    }
+    if (HasOption(options, fs::copy_options::skip_existing)) {
+      return;
+    }
+    if (!HasOption(options, fs::copy_options::overwrite_existing |
+                                fs::copy_options::update_existing)) {
+      error = system::errc::make_error_code(system::errc::file_exists);
+      util::format::PrintError("Error while copying {} to {}: file exists\n",
+                               from.generic_string(), to.generic_string());
+      return;
+    }
+    fs::remove(to, error);
+    if (error) {
+      util::format::PrintError("Error while deleting {}\n",
+                               to.generic_string());
+      return;
+    }
+  }
+  error.clear();
+
+  fs::copy_symlink(from, to, error);
+  if (error) {
+    util::format::PrintError("Error while copying symlink {} to {}\n",
+                             from.generic_string(), to.generic_string());
+  }
+}
+
+void CopyDir(const fs::path& from, const fs::path& to,
+             system::error_code& error, fs::copy_options options,
+             const util::crypto::Cipher* cipher, Attributes attributes) {
+  fs::create_directory(to, from, error);
+  if (error) {
+    util::format::PrintError("Error while creating dir {}\n",
+                             to.generic_string());
+    return;
+  }
+
+  if (!HasOption(options, fs::copy_options::recursive)) {
+    return;
+  }
+
+  for (auto it = fs::directory_iterator{from, error};
+       !error && it != fs::directory_iterator{}; it.increment(error)) {
+    CopyFromTo(it->path(), to / it->path().filename(), error, options,
+               cipher, attributes);
+    if (error) {
+      return;
+    }
+  }
+
+  if (error) {
+    util::format::PrintError("Error while iterating through dir {}\n",
+                             from.generic_string());
+  }
+}
+
 } // namespace
 
+void CopyFile(const fs::path& from, const fs::path& to,
+              fs::copy_options options, const util::crypto::Cipher* cipher,
+              Attributes attributes, system::error_code& error) {
+  FileDescriptor from_fd{::open(from.c_str(), O_RDONLY | O_CLOEXEC)};
+  struct stat from_stat;
+  if (from_fd.Get() < 0 || ::fstat(from_fd.Get(), &from_stat) < 0) {
+    error = LastError();
+    util::format::PrintError("Error while opening {}\n", from.generic_string());
+    return;
+  }
+
+  int flags = O_WRONLY | O_CREAT | O_CLOEXEC;
+  struct stat to_stat;
+  if (::stat(to.c_str(), &to_stat) == 0) {
+    if (HasOption(options, fs::copy_options::skip_existing) ||
+        (HasOption(options, fs::copy_options::update_existing) &&
+         !IsNewer(from_stat, to_stat))) {
+      return;
+    }
+    if (!HasOption(options, fs::copy_options::overwrite_existing |
+                                fs::copy_options::update_existing)) {
+      error = system::errc::make_error_code(system::errc::file_exists);
+      util::format::PrintError("Error while copying {} to {}: file exists\n",
+                               from.generic_string(), to.generic_string());
+      return;
+    }
+    flags |= O_TRUNC;
+  } else {
+    flags |= O_EXCL;
+  }
+
+  FileDescriptor to_fd{::open(to.c_str(), flags, from_stat.st_mode & 07777)};
+  if (to_fd.Get() < 0) {
+    error = LastError();
+    util::format::PrintError("Error while opening {}\n", to.generic_string());
+    return;
+  }
+
+  if (cipher != nullptr) {
+    cipher->Transform(from_fd.Get(), to_fd.Get(), from_stat.st_size, error);
+  } else {
+    CopySparse(from_fd.Get(), to_fd.Get(), from_stat.st_size, error);
+  }
+  if (attributes == Attributes::kCopy) {
+    if (!error && ::fchmod(to_fd.Get(), from_stat.st_mode & 07777) < 0) {
+      error = LastError();
+    }
+    // Incremental backups compare the write times of the copies with the
+    // sources, so the times are kept. It costs nothing with the fd at hand
+    const timespec kTimes[2] = {from_stat.st_atim, from_stat.st_mtim};
+    if (!error && ::futimens(to_fd.Get(), kTimes) < 0) {
+      error = LastError();
+    }
+  }
+  if (error) {
+    // A partial copy must not pass for the file, least of all the plaintext
+    // of the chunks decrypted before a forged one
+    ::unlink(to.c_str());
+    util::format::PrintError("Error while copying file {} to {}\n",
+                             from.generic_string(), to.generic_string());
+  }
+}
+
 void CopyFromTo(const fs::path& from, const fs::path& to,
-                system::error_code& error, fs::copy_options options) {
+                system::error_code& error, fs::copy_options options,
+                const util::crypto::Cipher* cipher, Attributes attributes) {
+  auto from_stat = fs::symlink_status(from, error);
+  if (error) {
+    util::format::PrintError("Error while getting info on {}\n",
+                             from.generic_string());
+    return;
+  }
+
+  if (from_stat.type() == fs::file_type::regular_file ||
+      from_stat.type() == fs::file_type::symlink_file) {
+    // As with fs::copy, a file copied to a dir is put into it
+    fs::path dest = to;
+    if (fs::symlink_status(to, error).type() ==
+        fs::file_type::directory_file) {
+      dest /= from.filename();
+    }
+    error.clear();
+    if (from_stat.type() == fs::file_type::symlink_file) {
+      CopySymlink(from, dest, options, error);
+    } else {
+      CopyFile(from, dest, options, cipher, attributes, error);
+    }
+    return;
+  }
+
+  if (from_stat.type() == fs::file_type::directory_file) {
+    CopyDir(from, to, error, options, cipher, attributes);
+    return;
+  }
+
   fs::copy(from, to, options, error);
   if (error) {
     util::format::PrintError("Error while copying dir {} to {}\n",
@@ -21,4 +320,43 @@ void CopyFromTo(const fs::path& from, const fs::path& to,
   }
 }
 
+void CopyTree(const fs::path& from, const fs::path& to,
+              fs::copy_options options, const util::crypto::Cipher* cipher,
+              Attributes attributes, util::job::Context& context,
+              system::error_code& error) {
+  if (context.CheckCancelled(error)) {
+    return;
+  }
+
+  system::error_code entry_error;
+  auto from_stat = fs::symlink_status(from, entry_error);
+  if (!entry_error && from_stat.type() == fs::file_type::directory_file) {
+    fs::create_directory(to, from, entry_error);
+    if (!entry_error) {
+      context.ReportProgress(from);
+    }
+
+    if (!entry_error && HasOption(options, fs::copy_options::recursive)) {
+      for (auto it = fs::directory_iterator{from, entry_error};
+           !entry_error && it != fs::directory_iterator{};
+           it.increment(entry_error)) {
+        CopyTree(it->path(), to / it->path().filename(), options, cipher,
+                 attributes, context, error);
+        if (error) {
+          return;
+        }
+      }
+    }
+  } else if (!entry_error) {
+    CopyFromTo(from, to, entry_error, options, cipher, attributes);
+    if (!entry_error) {
+      context.ReportProgress(from);
+    }
+  }
+
+  if (entry_error) {
+    context.ReportFileError(from, entry_error);
+  }
+}
+
 } // namespace util::filesystem
\ No newline at end of file
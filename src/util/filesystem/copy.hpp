@@ -1,5 +1,8 @@
 #pragma once
 
+#include "../crypto/cipher.hpp"
+#include "../job/context.hpp"
+
 #include <boost/filesystem.hpp>
 #include <boost/system/error_code.hpp>
 
@@ -12,7 +15,36 @@ namespace system = boost::system;
 
 } // namespace
 
+// What is done with the permissions and timestamps of a copied file
+enum class Attributes {
+  // They are set on the copy
+  kCopy,
+  // The copy is only created with the permissions of the source, the rest is
+  // left to the caller, e.g. to the restore, which applies the metadata table
+  // once all the data is written
+  kSkip,
+};
+
+// Copies a regular file keeping its holes and, as asked, its permissions and
+// timestamps. Honors the existing file handling options of fs::copy_options.
+// The contents are passed through the cipher unless it is null. A copy that
+// fails once the file is opened is removed
+void CopyFile(const fs::path& from, const fs::path& to,
+              fs::copy_options options, const util::crypto::Cipher* cipher,
+              Attributes attributes, system::error_code& error);
+
+// The same as fs::copy, except that regular files are copied with CopyFile
+// and symlinks are copied as symlinks, never followed
 void CopyFromTo(const fs::path& from, const fs::path& to,
-                system::error_code& error, fs::copy_options options);
+                system::error_code& error, fs::copy_options options,
+                const util::crypto::Cipher* cipher, Attributes attributes);
+
+// The same as CopyFromTo, except that an entry failed to be copied is
+// reported to the context and skipped. The error is only set once the job
+// is cancelled
+void CopyTree(const fs::path& from, const fs::path& to,
+              fs::copy_options options, const util::crypto::Cipher* cipher,
+              Attributes attributes, util::job::Context& context,
+              system::error_code& error);
 
 } // namespace util::filesystem
\ No newline at end of file
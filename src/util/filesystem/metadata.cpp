@@ -0,0 +1,347 @@
+#include "metadata.hpp"
+#include "../encoding.hpp"
+#include "../format.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <optional>
+#include <sstream>
+#include <string_view>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include <unistd.h>
+
+#include <fmt/format.h>
+
+#include <boost/filesystem.hpp>
+#include <boost/filesystem/fstream.hpp>
+
+namespace util::filesystem {
+
+namespace {
+
+namespace fs = boost::filesystem;
+namespace system = boost::system;
+
+const fs::path kMetadataFile{".backup_metadata"};
+
+// The amount of buffered records after which they are written to disk
+const size_t kWriteBufferSize = 1 << 20;
+
+system::error_code LastError() {
+  return {errno, system::system_category()};
+}
+
+// Errors meaning that the metadata can not be kept on this system or by
+// this user rather than that the restore is broken
+bool IsIgnorable(int error) {
+  return error == ENOENT || error == EPERM || error == ENOTSUP ||
+         error == ELOOP;
+}
+
+void CaptureXattrs(const fs::path& path, Metadata& metadata,
+                   system::error_code& error) {
+  ssize_t size = ::llistxattr(path.c_str(), nullptr, 0);
+  if (size < 0 && errno == ENOTSUP) {
+    return;
+  }
+
+  std::string names(std::max<ssize_t>(size, 0), '\0');
+  if (size > 0) {
+    size = ::llistxattr(path.c_str(), names.data(), names.size());
+  }
+  if (size < 0) {
+    error = LastError();
+    util::format::PrintError("Error while listing xattrs of {}\n",
+                             path.generic_string());
+    return;
+  }
+  names.resize(size);
+
+  for (size_t begin = 0; begin < names.size();) {
+    std::string name{names.c_str() + begin};
+    begin += name.size() + 1;
+
+    ssize_t len = ::lgetxattr(path.c_str(), name.c_str(), nullptr, 0);
+    if (len < 0) {
+      // The attribute is gone since the listing
+      continue;
+    }
+    std::string value(len, '\0');
+    len = ::lgetxattr(path.c_str(), name.c_str(), value.data(),
+                      value.size());
+    if (len < 0) {
+      continue;
+    }
+    value.resize(len);
+
+    metadata.xattrs.emplace_back(std::move(name), std::move(value));
+  }
+}
+
+bool ParseRecord(const std::string& line, std::string& path,
+                 Metadata& metadata, size_t& xattrs_count) {
+  std::istringstream record{line};
+  record >> metadata.mode >> metadata.uid >> metadata.gid >>
+      metadata.atime.tv_sec >> metadata.atime.tv_nsec >>
+      metadata.mtime.tv_sec >> metadata.mtime.tv_nsec >> xattrs_count;
+  std::string hex_path;
+  return record.get() == ' ' && std::getline(record, hex_path) &&
+         util::encoding::FromHex(hex_path, path);
+}
+
+// Reads the xattr lines that follow a record. Fails if the table ends before
+// them
+bool ParseXattrs(std::istream& file, size_t xattrs_count, Metadata& metadata) {
+  std::string line;
+  for (size_t i = 0; i < xattrs_count; ++i) {
+    if (!std::getline(file, line) || file.eof()) {
+      return false;
+    }
+    auto separator = line.find(' ');
+    if (separator == std::string::npos) {
+      return false;
+    }
+    std::string key;
+    std::string value;
+    if (!util::encoding::FromHex(line.substr(0, separator), key) ||
+        !util::encoding::FromHex(line.substr(separator + 1), value)) {
+      return false;
+    }
+    metadata.xattrs.emplace_back(std::move(key), std::move(value));
+  }
+  return true;
+}
+
+// The size of the table up to the end of its last complete record
+uintmax_t GetCompleteSize(std::istream& file) {
+  uintmax_t size = 0;
+  std::string line;
+  while (std::getline(file, line) && !file.eof()) {
+    std::string entry;
+    Metadata metadata;
+    size_t xattrs_count = 0;
+    uintmax_t record_size = line.size() + 1;
+    if (!ParseRecord(line, entry, metadata, xattrs_count)) {
+      break;
+    }
+    for (size_t i = 0; i < xattrs_count; ++i) {
+      if (!std::getline(file, line) || file.eof()) {
+        return size;
+      }
+      record_size += line.size() + 1;
+    }
+    size += record_size;
+  }
+  return size;
+}
+
+void ReportApplyError(const fs::path& root, std::string_view dir,
+                      std::string_view name, system::error_code& error) {
+  if (IsIgnorable(errno)) {
+    return;
+  }
+
+  error = LastError();
+  util::format::PrintError("Error while restoring metadata of {}/{}\n",
+                           (root / std::string{dir}).generic_string(), name);
+}
+
+void ApplyToEntry(const fs::path& root, std::string_view dir, int dir_fd,
+                  const char* name, const Metadata& metadata,
+                  system::error_code& error) {
+  // Ownership goes first, since chown drops the setuid bits and the file
+  // capabilities set before it
+  if (::fchownat(dir_fd, name, metadata.uid, metadata.gid,
+                 AT_SYMLINK_NOFOLLOW) < 0) {
+    ReportApplyError(root, dir, name, error);
+  }
+
+  // The mode and the xattrs of a symlink can not be set, and setting them
+  // through the symlink would change its target
+  if (S_ISLNK(metadata.mode)) {
+    const timespec kTimes[2] = {metadata.atime, metadata.mtime};
+    if (::utimensat(dir_fd, name, kTimes, AT_SYMLINK_NOFOLLOW) < 0) {
+      ReportApplyError(root, dir, name, error);
+    }
+    return;
+  }
+
+  if (!metadata.xattrs.empty()) {
+    int fd = ::openat(dir_fd, name,
+                      O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0) {
+      ReportApplyError(root, dir, name, error);
+    } else {
+      for (const auto& [key, value] : metadata.xattrs) {
+        if (::fsetxattr(fd, key.c_str(), value.data(), value.size(), 0) < 0) {
+          ReportApplyError(root, dir, name, error);
+        }
+      }
+      ::close(fd);
+    }
+  }
+
+  if (::fchmodat(dir_fd, name, metadata.mode & 07777, 0) < 0) {
+    ReportApplyError(root, dir, name, error);
+  }
+
+  const timespec kTimes[2] = {metadata.atime, metadata.mtime};
+  if (::utimensat(dir_fd, name, kTimes, AT_SYMLINK_NOFOLLOW) < 0) {
+    ReportApplyError(root, dir, name, error);
+  }
+}
+
+} // namespace
+
+Metadata CaptureMetadata(const fs::path& path, system::error_code& error) {
+  struct stat stat;
+  if (::lstat(path.c_str(), &stat) < 0) {
+    error = LastError();
+    util::format::PrintError("Error while getting info on {}\n",
+                             path.generic_string());
+    return {};
+  }
+
+  Metadata metadata{stat.st_mode, stat.st_uid, stat.st_gid, stat.st_atim,
+                    stat.st_mtim, {}};
+  CaptureXattrs(path, metadata, error);
+  return metadata;
+}
+
+MetadataWriter::MetadataWriter(const fs::path& dir)
+    : path_{dir / kMetadataFile} {
+}
+
+void MetadataWriter::Resume(system::error_code& error) {
+  fs::ifstream file{path_};
+  if (!file.is_open()) {
+    return;
+  }
+  uintmax_t size = GetCompleteSize(file);
+  file.close();
+
+  if (size < fs::file_size(path_, error) && !error) {
+    fs::resize_file(path_, size, error);
+  }
+  if (error) {
+    util::format::PrintError("Error while cutting torn records of {}\n",
+                             path_.generic_string());
+  }
+}
+
+void MetadataWriter::Write(const std::string& path, const Metadata& metadata,
+                           system::error_code& error) {
+  fmt::format_to(std::back_inserter(pending_), "{} {} {} {} {} {} {} {} {}\n",
+                 metadata.mode, metadata.uid, metadata.gid,
+                 metadata.atime.tv_sec, metadata.atime.tv_nsec,
+                 metadata.mtime.tv_sec, metadata.mtime.tv_nsec,
+                 metadata.xattrs.size(), util::encoding::ToHex(path));
+  for (const auto& [key, value] : metadata.xattrs) {
+    fmt::format_to(std::back_inserter(pending_), "{} {}\n",
+                   util::encoding::ToHex(key), util::encoding::ToHex(value));
+  }
+
+  if (pending_.size() >= kWriteBufferSize) {
+    Flush(error);
+  }
+}
+
+void MetadataWriter::Flush(system::error_code& error) {
+  if (pending_.empty()) {
+    return;
+  }
+
+  fs::ofstream file{path_, std::ios::app};
+  file << pending_;
+  file.flush();
+  if (!file) {
+    error = system::errc::make_error_code(system::errc::io_error);
+    util::format::PrintError("Error while writing {}\n",
+                             path_.generic_string());
+    return;
+  }
+
+  pending_.clear();
+}
+
+void LoadMetadataTable(const fs::path& dir, MetadataTable& table,
+                       system::error_code& error) {
+  auto path = dir / kMetadataFile;
+  fs::ifstream file{path};
+  if (!file.is_open()) {
+    return;
+  }
+
+  // A table is only committed once it is written as a whole, so a cut
+  // record means the table is damaged
+  std::string line;
+  while (std::getline(file, line)) {
+    std::string entry;
+    Metadata metadata;
+    size_t xattrs_count = 0;
+    if (file.eof() || !ParseRecord(line, entry, metadata, xattrs_count) ||
+        !ParseXattrs(file, xattrs_count, metadata)) {
+      error = system::errc::make_error_code(system::errc::illegal_byte_sequence);
+      util::format::PrintError("Malformed metadata record in {}\n",
+                               path.generic_string());
+      return;
+    }
+
+    table.insert_or_assign(std::move(entry), std::move(metadata));
+  }
+}
+
+void ApplyMetadataTable(const fs::path& root, const MetadataTable& table,
+                        system::error_code& error) {
+  // A dir is handled before its parent, so that its own permissions are set
+  // after the work inside it is done. The sort is stable, so the paths of
+  // a dir stay next to each other in the order of the table
+  std::vector<const MetadataTable::value_type*> records;
+  records.reserve(table.size());
+  for (const auto& record : table) {
+    records.push_back(&record);
+  }
+  std::ranges::stable_sort(records, std::greater{}, [](const auto* record) {
+    return std::ranges::count(record->first, '/');
+  });
+
+  // The names are the tails of the paths in the table, so they are passed on
+  // without copies
+  std::optional<std::string_view> dir;
+  int dir_fd = -1;
+  for (const auto* record : records) {
+    const auto& [path, metadata] = *record;
+    auto separator = path.rfind('/');
+    auto dir_size = separator == std::string::npos ? 0 : separator;
+    auto name = separator == std::string::npos ? 0 : separator + 1;
+    if (name == path.size()) {
+      continue;
+    }
+
+    auto record_dir = std::string_view{path}.substr(0, dir_size);
+    if (dir != record_dir) {
+      if (dir_fd >= 0) {
+        ::close(dir_fd);
+      }
+      dir = record_dir;
+      dir_fd = ::open((root / std::string{record_dir}).c_str(),
+                      O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+      if (dir_fd < 0) {
+        ReportApplyError(root, record_dir, {}, error);
+      }
+    }
+    if (dir_fd >= 0) {
+      ApplyToEntry(root, record_dir, dir_fd, path.c_str() + name, metadata,
+                   error);
+    }
+  }
+
+  if (dir_fd >= 0) {
+    ::close(dir_fd);
+  }
+}
+
+} // namespace util::filesystem
\ No newline at end of file
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <sys/stat.h>
+
+#include <boost/filesystem.hpp>
+#include <boost/system/error_code.hpp>
+
+namespace util::filesystem {
+
+namespace {
+
+namespace fs = boost::filesystem;
+namespace system = boost::system;
+
+} // namespace
+
+struct Metadata {
+  mode_t mode = 0;
+  uid_t uid = 0;
+  gid_t gid = 0;
+  timespec atime{};
+  timespec mtime{};
+  std::vector<std::pair<std::string, std::string>> xattrs;
+};
+
+// Metadata of a snapshot keyed by the paths relative to its root. It is held
+// as a whole, so the restore takes memory linear in the size of the tree
+using MetadataTable = std::map<std::string, Metadata>;
+
+// Symlinks are not followed, since they are copied as symlinks
+Metadata CaptureMetadata(const fs::path& path, system::error_code& error);
+
+// Appends the metadata of the copied paths to the table file kept in the dir.
+// The records are buffered until Flush
+class MetadataWriter {
+ public:
+  explicit MetadataWriter(const fs::path& dir);
+
+  // Cuts the table left by an interrupted run back to its last complete
+  // record, so that the records appended next do not merge with a torn one
+  void Resume(system::error_code& error);
+
+  void Write(const std::string& path, const Metadata& metadata,
+             system::error_code& error);
+
+  void Flush(system::error_code& error);
+
+ private:
+  fs::path path_;
+  std::string pending_;
+};
+
+// Merges the table file kept in the dir into the table, overriding the
+// records of the same paths. A dir without a table adds nothing, a cut or
+// garbled table is an error
+void LoadMetadataTable(const fs::path& dir, MetadataTable& table,
+                       system::error_code& error);
+
+// Restores ownership, xattrs, permissions and timestamps of the tree in one
+// pass after all the data is written. The paths of a dir are handled through
+// a single dir fd, and the deepest dirs go first
+void ApplyMetadataTable(const fs::path& root, const MetadataTable& table,
+                        system::error_code& error);
+
+} // namespace util::filesystem
\ No newline at end of file
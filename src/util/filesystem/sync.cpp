@@ -0,0 +1,42 @@
+#include "sync.hpp"
+#include "../format.hpp"
+
+#include <cerrno>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <boost/filesystem.hpp>
+#include <boost/system/error_code.hpp>
+
+namespace util::filesystem {
+
+namespace {
+
+namespace fs = boost::filesystem;
+namespace system = boost::system;
+
+// Runs the sync call on a descriptor of the path, which may be a dir
+void SyncWith(int (*sync)(int), const fs::path& path,
+              system::error_code& error) {
+  int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0 || sync(fd) < 0) {
+    error = {errno, system::system_category()};
+    util::format::PrintError("Error while syncing {}\n", path.generic_string());
+  }
+  if (fd >= 0) {
+    ::close(fd);
+  }
+}
+
+} // namespace
+
+void Sync(const fs::path& path, system::error_code& error) {
+  SyncWith(::fsync, path, error);
+}
+
+void SyncFilesystem(const fs::path& path, system::error_code& error) {
+  SyncWith(::syncfs, path, error);
+}
+
+} // namespace util::filesystem
\ No newline at end of file
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <boost/filesystem.hpp>
+#include <boost/system/error_code.hpp>
+
+namespace util::filesystem {
+
+namespace {
+
+namespace fs = boost::filesystem;
+namespace system = boost::system;
+
+} // namespace
+
+// Waits for the contents of the file, or the entries of the dir, to reach
+// the disk. A renamed or created entry is only durable once its parent dir
+// is synced
+void Sync(const fs::path& path, system::error_code& error);
+
+// Waits for everything written to the filesystem the path is on to reach the
+// disk. One call is cheaper than syncing a batch of files one by one
+void SyncFilesystem(const fs::path& path, system::error_code& error);
+
+} // namespace util::filesystem
\ No newline at end of file
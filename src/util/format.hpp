@@ -4,10 +4,26 @@
 
 namespace util::format {
 
+// Set by the threads of library jobs, which report errors through the job
+// handles instead of the terminal
+inline thread_local bool is_quiet = false;
+
 template <typename... T>
 void PrintError(std::string msg, T&&... args) {
+  if (is_quiet) {
+    return;
+  }
   fmt::print(fmt::fg(fmt::color::red) | fmt::emphasis::bold, std::move(msg),
              std::forward<T>(args)...);
 }
 
+template <typename... T>
+void PrintInfo(std::string msg, T&&... args) {
+  if (is_quiet) {
+    return;
+  }
+  fmt::print(fmt::fg(fmt::color::sky_blue), std::move(msg),
+             std::forward<T>(args)...);
+}
+
 } // namespace util::format
\ No newline at end of file
@@ -0,0 +1,57 @@
+#include "context.hpp"
+
+#include <mutex>
+
+#include <boost/system/error_code.hpp>
+
+namespace util::job {
+
+namespace {
+namespace fs = boost::filesystem;
+namespace system = boost::system;
+} // namespace
+
+Context::Context(ProgressCallback on_progress)
+    : on_progress_{std::move(on_progress)} {
+}
+
+void Context::Cancel() {
+  is_cancelled_ = true;
+}
+
+bool Context::IsCancelled() const {
+  return is_cancelled_;
+}
+
+bool Context::CheckCancelled(system::error_code& error) const {
+  if (is_cancelled_) {
+    error = system::errc::make_error_code(system::errc::operation_canceled);
+  }
+  return is_cancelled_;
+}
+
+void Context::ReportProgress(const fs::path& path) {
+  size_t entries_done = ++entries_done_;
+  if (!on_progress_) {
+    return;
+  }
+
+  size_t file_errors = 0;
+  {
+    std::lock_guard lock{mutex_};
+    file_errors = file_errors_.size();
+  }
+  on_progress_({entries_done, file_errors, path.generic_string()});
+}
+
+void Context::ReportFileError(const fs::path& path, system::error_code error) {
+  std::lock_guard lock{mutex_};
+  file_errors_.push_back({path.generic_string(), error});
+}
+
+std::vector<FileError> Context::GetFileErrors() const {
+  std::lock_guard lock{mutex_};
+  return file_errors_;
+}
+
+} // namespace util::job
\ No newline at end of file
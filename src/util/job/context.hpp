@@ -0,0 +1,64 @@
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+#include <boost/system/error_code.hpp>
+
+namespace util::job {
+
+namespace {
+namespace fs = boost::filesystem;
+namespace system = boost::system;
+} // namespace
+
+struct FileError {
+  std::string path;
+  system::error_code error;
+};
+
+struct Progress {
+  size_t entries_done = 0;
+  size_t file_errors = 0;
+  std::string path;
+};
+
+using ProgressCallback = std::function<void(const Progress&)>;
+
+// Shared between a running backup or restore and whoever drives it: the
+// driver cancels the run and gets its progress, the run reports the entries
+// it has handled and the ones it has failed on and goes on
+class Context {
+ public:
+  explicit Context(ProgressCallback on_progress);
+
+  Context(const Context&) = delete;
+  Context& operator=(const Context&) = delete;
+
+  void Cancel();
+
+  bool IsCancelled() const;
+
+  // Sets the error to operation_canceled if the run should stop
+  bool CheckCancelled(system::error_code& error) const;
+
+  void ReportProgress(const fs::path& path);
+
+  void ReportFileError(const fs::path& path, system::error_code error);
+
+  std::vector<FileError> GetFileErrors() const;
+
+ private:
+  ProgressCallback on_progress_;
+  std::atomic<bool> is_cancelled_ = false;
+  std::atomic<size_t> entries_done_ = 0;
+
+  mutable std::mutex mutex_;
+  std::vector<FileError> file_errors_;
+};
+
+} // namespace util::job
\ No newline at end of file